@@ -0,0 +1,392 @@
+#include "editor.h"
+#include "window.h"
+#include "view.h"
+#include "buffer.h"
+#include "change.h"
+#include "config.h"
+#include "color.h"
+#include "syntax.h"
+#include "state.h"
+#include "hl.h"
+#include "gbuf.h"
+#include "path.h"
+#include "filetype.h"
+#include "regexp.h"
+#include "newline.h"
+#include "common.h"
+
+#include <glob.h>
+#include <sys/time.h>
+
+/*
+ * Highlighter benchmark. Run from the source directory:
+ *
+ *     make bench && ./bench [file]...
+ *
+ * Every syntax in share/syntax highlights a synthetic corpus. Given files,
+ * or by default the source tree, are grouped by detected filetype and
+ * highlighted with their own syntax.
+ */
+
+// size of synthetic corpus
+#define SYNTHETIC_SIZE (2 * 1024 * 1024)
+
+// best of this many runs is reported
+#define RUNS 3
+
+#define EDITS 1000
+
+// lines redrawn after each edit
+#define SCREEN_LINES 50
+
+static const char *default_files[] = {
+	"*.c",
+	"*.h",
+	"Makefile*",
+	"share/binding/*",
+	"share/color/*",
+	"share/compiler/*",
+	"share/filetype",
+	"share/rc",
+	"share/syntax/*",
+	"Documentation/*.txt",
+};
+
+struct corpus {
+	const char *filetype;
+	struct gbuf text;
+	int files;
+};
+
+static PTR_ARRAY(corpora);
+static PTR_ARRAY(syntaxes);
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static const char *pick(const char * const *strs, int count)
+{
+	return strs[rnd() % count];
+}
+
+#define PICK(strs) pick(strs, ARRAY_COUNT(strs))
+
+// something every syntax has states for
+static void add_synthetic_line(struct gbuf *buf)
+{
+	static const char * const words[] = {
+		"if", "else", "return", "for", "while", "function", "def", "int",
+		"var", "struct", "class", "import", "end", "foo", "bar_baz",
+		"counter", "x", "self", "this", "NULL", "true",
+	};
+	static const char * const tokens[] = {
+		"(", ")", "{", "}", "[", "]", ";", ",", ".", " = ", " == ",
+		" + ", " * ", " -> ", ": ", " && ", " < ", " > ", "::",
+	};
+	static const char * const others[] = {
+		"\"a string with \\\"escapes\\\" in it\"", "'c'", "'\\n'", "42",
+		"0x1f", "3.14e-2", "$var", "${x}", "<div class=\"x\">", "</div>",
+		"&amp;", "@decorator", "#include <stdio.h>", "%d",
+	};
+	static const char * const comments[] = {
+		"// line comment with some words",
+		"# hash comment with some words",
+		"-- dash comment",
+		"/* block comment */",
+		"<!-- markup comment -->",
+	};
+	int i, n = 3 + rnd() % 12;
+
+	for (i = rnd() % 3; i > 0; i--)
+		gbuf_add_byte(buf, '\t');
+	switch (rnd() % 16) {
+	case 0:
+		gbuf_add_str(buf, "/*\n * multi line comment\n * with more lines\n */");
+		break;
+	case 1:
+		gbuf_add_str(buf, "cat <<EOF\nheredoc $body text\nEOF");
+		break;
+	case 2:
+		gbuf_add_str(buf, PICK(comments));
+		break;
+	default:
+		for (i = 0; i < n; i++) {
+			if (rnd() % 4) {
+				gbuf_add_str(buf, PICK(words));
+			} else {
+				gbuf_add_str(buf, PICK(others));
+			}
+			gbuf_add_str(buf, rnd() % 3 ? " " : PICK(tokens));
+		}
+		if (rnd() % 4 == 0) {
+			gbuf_add_byte(buf, ' ');
+			gbuf_add_str(buf, PICK(comments));
+		}
+		break;
+	}
+	gbuf_add_byte(buf, '\n');
+}
+
+static struct corpus *find_corpus(const char *filetype)
+{
+	struct corpus *c;
+	int i;
+
+	for (i = 0; i < corpora.count; i++) {
+		c = corpora.ptrs[i];
+		if (streq(c->filetype, filetype))
+			return c;
+	}
+	c = xnew0(struct corpus, 1);
+	c->filetype = xstrdup(filetype);
+	ptr_array_add(&corpora, c);
+	return c;
+}
+
+// like buffer_detect_filetype() but without a buffer
+static const char *detect_filetype(const char *filename, const char *buf, long size)
+{
+	const char *nl = memchr(buf, '\n', size);
+	long len = nl ? nl - buf : size;
+	char *interpreter = NULL;
+	char *absolute = path_absolute(filename);
+	const char *ft;
+	PTR_ARRAY(m);
+
+	if (regexp_match("^#!\\s*/.*(/env\\s+|/)([a-zA-Z_-]+)[0-9.]*(\\s|$)", buf, len, &m)) {
+		interpreter = xstrdup(m.ptrs[2]);
+		ptr_array_free(&m);
+	}
+	ft = find_ft(absolute, interpreter, buf, len);
+	free(interpreter);
+	free(absolute);
+	return ft;
+}
+
+static void add_file(const char *filename)
+{
+	const char *ft;
+	char *buf;
+	ssize_t size;
+
+	size = read_file(filename, &buf);
+	if (size < 0)
+		return;
+	ft = detect_filetype(filename, buf, size);
+	if (size > 0 && ft && find_syntax(ft)) {
+		struct corpus *c = find_corpus(ft);
+		gbuf_add_buf(&c->text, buf, size);
+		if (buf[size - 1] != '\n')
+			gbuf_add_byte(&c->text, '\n');
+		c->files++;
+	}
+	free(buf);
+}
+
+static struct buffer *open_corpus(struct syntax *syn, struct gbuf *text)
+{
+	struct buffer *b = open_empty_buffer();
+
+	view = window_add_buffer(window, b);
+	buffer = b;
+	begin_change(CHANGE_MERGE_NONE);
+	buffer_insert_bytes(text->buffer, text->len);
+	end_change();
+	b->syn = syn;
+	hl_reset(b);
+	return b;
+}
+
+static void close_corpus(struct buffer *b)
+{
+	remove_view(b->views.ptrs[0]);
+}
+
+// start states of all lines from scratch, as when a file is opened
+static double bench_fill(struct buffer *b)
+{
+	double t, best = 0;
+	int i;
+
+	for (i = 0; i < RUNS; i++) {
+		hl_reset(b);
+		t = now();
+		hl_fill_start_states(b, b->nl, 0);
+		t = now() - t;
+		if (!i || t < best)
+			best = t;
+	}
+	return best;
+}
+
+// like update_range() in screen-view.c, returns number of lines drawn
+static int draw_screen(struct buffer *b, int top)
+{
+	struct block_iter bi;
+	int i;
+
+	bi.head = &b->blocks;
+	block_iter_goto_line(&bi, top);
+	hl_fill_start_states(b, top, 0);
+	for (i = 0; i < SCREEN_LINES && !block_iter_is_eof(&bi); i++) {
+		struct lineref lr;
+		int next_changed;
+
+		fill_line_nl_ref(&bi, &lr);
+		hl_line(b, lr.line, lr.size, top + i, &next_changed);
+		block_iter_next_line(&bi);
+	}
+	return i;
+}
+
+// colors of every line, as when scrolling through a file page by page
+static double bench_lines(struct buffer *b)
+{
+	double t, best = 0;
+	int i, top;
+
+	for (i = 0; i < RUNS; i++) {
+		t = now();
+		for (top = 0; top < b->nl; top += draw_screen(b, top))
+			;
+		t = now() - t;
+		if (!i || t < best)
+			best = t;
+	}
+	return best;
+}
+
+// random small edits, each followed by redrawing the screen around it
+static double bench_edits(struct buffer *b)
+{
+	static const char * const snippets[] = {
+		"x", " ", "\n", "\"", "'", "/*", "*/", "#", "//", "<!--", "-->",
+		"{\n", "}\n", "<<EOF\n", "EOF\n",
+	};
+	double t = now();
+	int i;
+
+	seed = 1;
+	for (i = 0; i < EDITS; i++) {
+		int line = rnd() % b->nl;
+		struct lineref lr;
+		long col;
+
+		block_iter_goto_line(&view->cursor, line);
+		fetch_this_line(&view->cursor, &lr);
+		col = rnd() % (lr.size + 1);
+		block_iter_skip_bytes(&view->cursor, col);
+
+		begin_change(CHANGE_MERGE_NONE);
+		if (rnd() % 3 || col == lr.size) {
+			const char *str = PICK(snippets);
+			buffer_insert_bytes(str, strlen(str));
+		} else {
+			long len = 1 + rnd() % 3;
+			if (len > lr.size - col)
+				len = lr.size - col;
+			buffer_delete_bytes(len);
+		}
+		end_change();
+
+		line -= SCREEN_LINES / 2;
+		draw_screen(b, line < 0 ? 0 : line);
+	}
+	return now() - t;
+}
+
+static void bench(struct syntax *syn, const char *name, struct gbuf *text)
+{
+	struct buffer *b = open_corpus(syn, text);
+	double mb = text->len / (1024.0 * 1024.0);
+	double fill = bench_fill(b);
+	double lines = bench_lines(b);
+	long nl = b->nl;
+	double edits = bench_edits(b);
+
+	printf("%-14s %-16s %7.2f %9.1f %9.1f %8.1f %8.1f\n", syn->name, name, mb,
+		mb / fill, mb / lines, lines * 1e9 / nl, edits * 1e6 / EDITS);
+	close_corpus(b);
+}
+
+static void load_syntaxes(void)
+{
+	glob_t g;
+	size_t i;
+
+	if (glob("share/syntax/*", 0, NULL, &g)) {
+		fprintf(stderr, "No syntax files found, run bench from the source directory\n");
+		exit(1);
+	}
+	for (i = 0; i < g.gl_pathc; i++) {
+		struct syntax *syn = find_syntax(path_basename(g.gl_pathv[i]));
+		int err;
+
+		if (!syn)
+			syn = load_syntax_file(g.gl_pathv[i], true, &err);
+		if (syn)
+			ptr_array_add(&syntaxes, syn);
+	}
+	globfree(&g);
+	update_all_syntax_colors();
+}
+
+int main(int argc, char *argv[])
+{
+	GBUF(synthetic);
+	glob_t g;
+	size_t i;
+
+	// don't read user's own syntax or config files
+	home_dir = xstrdup("/nonexistent");
+	pkgdatadir = "share";
+	charset = xstrdup("UTF-8");
+	init_nl_kernels();
+	window = new_window();
+
+	fill_builtin_colors();
+	read_config(commands, "share/color/darkgray", true);
+	read_config(commands, "share/filetype", true);
+	load_syntaxes();
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++)
+			add_file(argv[i]);
+	} else {
+		memset(&g, 0, sizeof(g));
+		for (i = 0; i < ARRAY_COUNT(default_files); i++)
+			glob(default_files[i], i ? GLOB_APPEND : 0, NULL, &g);
+		for (i = 0; i < g.gl_pathc; i++)
+			add_file(g.gl_pathv[i]);
+		globfree(&g);
+	}
+
+	while (synthetic.len < SYNTHETIC_SIZE)
+		add_synthetic_line(&synthetic);
+
+	printf("%-14s %-16s %7s %9s %9s %8s %8s\n", "syntax", "corpus", "MB",
+		"fill MB/s", "line MB/s", "ns/line", "us/edit");
+	for (i = 0; i < corpora.count; i++) {
+		struct corpus *c = corpora.ptrs[i];
+		char name[32];
+
+		snprintf(name, sizeof(name), "%d files", c->files);
+		bench(find_syntax(c->filetype), name, &c->text);
+	}
+	for (i = 0; i < syntaxes.count; i++)
+		bench(syntaxes.ptrs[i], "synthetic", &synthetic);
+	return 0;
+}
@@ -0,0 +1,159 @@
+#include "block-pool.h"
+#include "common.h"
+
+// keeps payloads that follow a header in a slab aligned
+#define HEADER_SIZE ROUND_UP(sizeof(struct block), 16)
+
+static int size_class(long size)
+{
+	int c = 0;
+
+	while ((64L << c) < size)
+		c++;
+	return c;
+}
+
+static void *slab_alloc(struct block_pool *pool, long size)
+{
+	void *ptr;
+
+	if (pool->avail < size) {
+		void **slab;
+
+		// put rest of the current slab to free lists
+		while (pool->avail >= 64) {
+			int c = size_class(pool->avail + 1) - 1;
+			long csize = 64L << c;
+
+			*(void **)pool->pos = pool->free_data[c];
+			pool->free_data[c] = pool->pos;
+			pool->pos += csize;
+			pool->avail -= csize;
+		}
+
+		slab = xmalloc(BLOCK_POOL_SLAB_SIZE);
+		*slab = pool->slabs;
+		pool->slabs = slab;
+		pool->pos = (char *)slab + 64;
+		pool->avail = BLOCK_POOL_SLAB_SIZE - 64;
+		pool->stats.slabs++;
+	}
+	ptr = pool->pos;
+	pool->pos += size;
+	pool->avail -= size;
+	return ptr;
+}
+
+struct block *block_pool_get_block(struct block_pool *pool)
+{
+	struct block *blk = pool->free_blocks;
+
+	if (blk) {
+		pool->free_blocks = BLOCK(blk->node.next);
+	} else {
+		blk = slab_alloc(pool, HEADER_SIZE);
+	}
+	memset(blk, 0, sizeof(*blk));
+	pool->stats.blocks++;
+	return blk;
+}
+
+void block_pool_put_block(struct block_pool *pool, struct block *blk)
+{
+	blk->node.next = pool->free_blocks ? &pool->free_blocks->node : NULL;
+	pool->free_blocks = blk;
+	pool->stats.blocks--;
+}
+
+/*
+ * Allocate at least *allocp bytes. *allocp is set to the real size which
+ * must be passed to block_pool_put_data().
+ */
+unsigned char *block_pool_get_data(struct block_pool *pool, long *allocp)
+{
+	long size = *allocp;
+	unsigned char *data;
+	int c;
+
+	pool->stats.allocs++;
+	if (size > BLOCK_POOL_MAX_DATA) {
+		size = ROUND_UP(size, 64);
+		pool->stats.large++;
+		pool->stats.large_bytes += size;
+		*allocp = size;
+		return xmalloc(size);
+	}
+
+	c = size_class(size);
+	size = 64L << c;
+	data = pool->free_data[c];
+	if (data) {
+		pool->free_data[c] = *(void **)data;
+	} else {
+		data = slab_alloc(pool, size);
+	}
+	pool->stats.data_bytes += size;
+	*allocp = size;
+	return data;
+}
+
+void block_pool_put_data(struct block_pool *pool, unsigned char *data, long alloc)
+{
+	pool->stats.frees++;
+	if (alloc > BLOCK_POOL_MAX_DATA) {
+		pool->stats.large--;
+		pool->stats.large_bytes -= alloc;
+		free(data);
+	} else {
+		int c = size_class(alloc);
+
+		*(void **)data = pool->free_data[c];
+		pool->free_data[c] = data;
+		pool->stats.data_bytes -= alloc;
+	}
+}
+
+// keep used bytes of data, returns new payload of at least size bytes
+unsigned char *block_pool_grow_data(struct block_pool *pool, unsigned char *data, long used, long *allocp, long size)
+{
+	long alloc = *allocp;
+	unsigned char *new;
+
+	if (alloc > BLOCK_POOL_MAX_DATA) {
+		// very long line, let realloc() do its job
+		size = ROUND_UP(size, 64);
+		pool->stats.large_bytes += size - alloc;
+		*allocp = size;
+		return xrealloc(data, size);
+	}
+
+	*allocp = size;
+	new = block_pool_get_data(pool, allocp);
+	memcpy(new, data, used);
+	block_pool_put_data(pool, data, alloc);
+	return new;
+}
+
+// bytes of slabs not used by live headers or payloads
+long block_pool_unused(const struct block_pool *pool)
+{
+	const struct block_pool_stats *s = &pool->stats;
+
+	return s->slabs * BLOCK_POOL_SLAB_SIZE - s->blocks * HEADER_SIZE - s->data_bytes;
+}
+
+/*
+ * Free all slabs. Blocks and payloads allocated from this pool become
+ * invalid. Large payloads must be freed by the caller.
+ */
+void block_pool_reset(struct block_pool *pool)
+{
+	void *slab = pool->slabs;
+
+	while (slab) {
+		void *next = *(void **)slab;
+		free(slab);
+		slab = next;
+	}
+	clear(pool);
+}
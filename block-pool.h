@@ -0,0 +1,52 @@
+#ifndef BLOCK_POOL_H
+#define BLOCK_POOL_H
+
+#include "iter.h"
+
+// payloads are rounded up to 64 << n bytes, n = 0..BLOCK_POOL_CLASSES-1
+#define BLOCK_POOL_CLASSES 11
+#define BLOCK_POOL_MAX_DATA (64L << (BLOCK_POOL_CLASSES - 1))
+#define BLOCK_POOL_SLAB_SIZE (4 * BLOCK_POOL_MAX_DATA)
+
+struct block_pool_stats {
+	long slabs;
+	long blocks;
+	// bytes in payloads allocated from slabs
+	long data_bytes;
+	// payloads larger than BLOCK_POOL_MAX_DATA are malloced
+	long large;
+	long large_bytes;
+	// total number of allocations and frees served by the pool
+	long allocs;
+	long frees;
+	// blocks pointing to the mapped file, see block_new_mapped()
+	long mapped;
+	long mapped_bytes;
+};
+
+/*
+ * Per-buffer allocator for blocks. Headers and payloads are carved from
+ * big slabs and recycled through free lists. Slabs are returned to the
+ * system only when the whole pool is reset.
+ */
+struct block_pool {
+	// slabs are linked through their first word
+	void *slabs;
+	char *pos;
+	long avail;
+
+	struct block *free_blocks;
+	void *free_data[BLOCK_POOL_CLASSES];
+
+	struct block_pool_stats stats;
+};
+
+struct block *block_pool_get_block(struct block_pool *pool);
+void block_pool_put_block(struct block_pool *pool, struct block *blk);
+unsigned char *block_pool_get_data(struct block_pool *pool, long *allocp);
+unsigned char *block_pool_grow_data(struct block_pool *pool, unsigned char *data, long used, long *allocp, long size);
+void block_pool_put_data(struct block_pool *pool, unsigned char *data, long alloc);
+long block_pool_unused(const struct block_pool *pool);
+void block_pool_reset(struct block_pool *pool);
+
+#endif
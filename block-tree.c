@@ -0,0 +1,293 @@
+#include "block-tree.h"
+#include "common.h"
+
+/*
+ * Blocks are kept in a doubly linked list and, in the same order, in a
+ * treap (randomized balanced binary tree). Every tree node knows total size
+ * and newline count of its subtree so that offset and line number lookups
+ * don't need to walk the whole list.
+ *
+ * The root is not stored anywhere. It is found by following parent pointers
+ * from any block in the tree. The expected depth of the tree is O(log n).
+ */
+
+static unsigned int random_prio(void)
+{
+	static unsigned int x = 2463534242U;
+
+	// xorshift32
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static inline long tree_size(const struct block *blk)
+{
+	return blk ? blk->tree_size : 0;
+}
+
+static inline long tree_nl(const struct block *blk)
+{
+	return blk ? blk->tree_nl : 0;
+}
+
+static void recalc(struct block *blk)
+{
+	blk->tree_size = tree_size(blk->left) + blk->size + tree_size(blk->right);
+	blk->tree_nl = tree_nl(blk->left) + blk->nl + tree_nl(blk->right);
+}
+
+static void recalc_path(struct block *blk)
+{
+	while (blk) {
+		recalc(blk);
+		blk = blk->parent;
+	}
+}
+
+static struct block *tree_root(struct block *blk)
+{
+	while (blk->parent)
+		blk = blk->parent;
+	return blk;
+}
+
+static void replace_child(struct block *parent, struct block *old, struct block *new)
+{
+	if (parent) {
+		if (parent->left == old) {
+			parent->left = new;
+		} else {
+			parent->right = new;
+		}
+	}
+	new->parent = parent;
+}
+
+// make blk parent of its current parent
+static void rotate_up(struct block *blk)
+{
+	struct block *parent = blk->parent;
+	struct block *moved;
+
+	replace_child(parent->parent, parent, blk);
+	if (parent->left == blk) {
+		moved = blk->right;
+		parent->left = moved;
+		blk->right = parent;
+	} else {
+		moved = blk->left;
+		parent->right = moved;
+		blk->left = parent;
+	}
+	if (moved)
+		moved->parent = parent;
+	parent->parent = blk;
+
+	recalc(parent);
+	recalc(blk);
+}
+
+static void tree_insert(struct block *blk, struct block *prev, struct block *next)
+{
+	blk->parent = NULL;
+	blk->left = NULL;
+	blk->right = NULL;
+	blk->prio = random_prio();
+
+	// new leaf goes to the right of prev or to the left of next
+	if (next && !next->left) {
+		next->left = blk;
+		blk->parent = next;
+	} else if (prev) {
+		BUG_ON(prev->right);
+		prev->right = blk;
+		blk->parent = prev;
+	}
+
+	while (blk->parent && blk->parent->prio > blk->prio)
+		rotate_up(blk);
+	recalc_path(blk);
+}
+
+void block_insert_before(struct block *blk, struct block *pos)
+{
+	struct block *prev = NULL;
+
+	if (pos->left) {
+		prev = pos->left;
+		while (prev->right)
+			prev = prev->right;
+	}
+	list_add_before(&blk->node, &pos->node);
+	tree_insert(blk, prev, pos);
+}
+
+void block_append(struct block *blk, struct list_head *head)
+{
+	struct block *prev = NULL;
+
+	if (!list_empty(head))
+		prev = BLOCK(head->prev);
+	list_add_before(&blk->node, head);
+	tree_insert(blk, prev, NULL);
+}
+
+void block_remove(struct block *blk)
+{
+	struct block *parent;
+
+	// rotate down until leaf
+	while (blk->left || blk->right) {
+		struct block *child = blk->left;
+
+		if (!child || (blk->right && blk->right->prio < child->prio))
+			child = blk->right;
+		rotate_up(child);
+	}
+
+	parent = blk->parent;
+	if (parent) {
+		if (parent->left == blk) {
+			parent->left = NULL;
+		} else {
+			parent->right = NULL;
+		}
+		recalc_path(parent);
+	}
+	blk->parent = NULL;
+	list_del(&blk->node);
+}
+
+// must be called after size or nl of a block in the tree has changed
+void block_counts_changed(struct block *blk)
+{
+	recalc_path(blk);
+}
+
+// number of bytes before the block
+long block_start_offset(const struct block *blk)
+{
+	long offset = tree_size(blk->left);
+
+	while (blk->parent) {
+		const struct block *parent = blk->parent;
+
+		if (parent->right == blk)
+			offset += tree_size(parent->left) + parent->size;
+		blk = parent;
+	}
+	return offset;
+}
+
+// number of lines before the block
+long block_start_line(const struct block *blk)
+{
+	long nl = tree_nl(blk->left);
+
+	while (blk->parent) {
+		const struct block *parent = blk->parent;
+
+		if (parent->right == blk)
+			nl += tree_nl(parent->left) + parent->nl;
+		blk = parent;
+	}
+	return nl;
+}
+
+// total size of all blocks
+long block_tree_size(struct list_head *head)
+{
+	return tree_root(BLOCK(head->next))->tree_size;
+}
+
+/*
+ * Find first block which ends at or after offset. Offset is converted to
+ * offset relative to the returned block. Returns NULL if offset is past
+ * end of the buffer.
+ */
+struct block *block_find_offset(struct list_head *head, long *offset)
+{
+	struct block *blk = tree_root(BLOCK(head->next));
+	long pos = *offset;
+
+	while (blk) {
+		long left = tree_size(blk->left);
+
+		if (blk->left && pos <= left) {
+			blk = blk->left;
+			continue;
+		}
+		pos -= left;
+		if (pos <= blk->size) {
+			*offset = pos;
+			return blk;
+		}
+		pos -= blk->size;
+		blk = blk->right;
+	}
+	return NULL;
+}
+
+/*
+ * Find first block which contains line (zero based) or the last block.
+ * Line is converted to number of lines to skip in the returned block.
+ */
+struct block *block_find_line(struct list_head *head, long *line)
+{
+	struct block *blk = tree_root(BLOCK(head->next));
+	long nl = *line;
+
+	while (1) {
+		long left = tree_nl(blk->left);
+
+		if (blk->left && nl <= left) {
+			blk = blk->left;
+			continue;
+		}
+		nl -= left;
+		if (nl <= blk->nl || !blk->right)
+			break;
+		nl -= blk->nl;
+		blk = blk->right;
+	}
+	*line = nl;
+	return blk;
+}
+
+static void check_subtree(const struct block *blk)
+{
+	if (blk->left) {
+		BUG_ON(blk->left->parent != blk);
+		BUG_ON(blk->left->prio < blk->prio);
+		check_subtree(blk->left);
+	}
+	if (blk->right) {
+		BUG_ON(blk->right->parent != blk);
+		BUG_ON(blk->right->prio < blk->prio);
+		check_subtree(blk->right);
+	}
+	BUG_ON(blk->tree_size != tree_size(blk->left) + blk->size + tree_size(blk->right));
+	BUG_ON(blk->tree_nl != tree_nl(blk->left) + blk->nl + tree_nl(blk->right));
+}
+
+// expensive, call only if DEBUG > 2
+void block_tree_check(struct list_head *head)
+{
+	struct block *root = tree_root(BLOCK(head->next));
+	struct block *blk;
+	long size = 0;
+	long nl = 0;
+
+	check_subtree(root);
+	list_for_each_entry(blk, head, node) {
+		BUG_ON(tree_root(blk) != root);
+		BUG_ON(block_start_offset(blk) != size);
+		BUG_ON(block_start_line(blk) != nl);
+		size += blk->size;
+		nl += blk->nl;
+	}
+	BUG_ON(root->tree_size != size);
+	BUG_ON(root->tree_nl != nl);
+}
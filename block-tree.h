@@ -0,0 +1,17 @@
+#ifndef BLOCK_TREE_H
+#define BLOCK_TREE_H
+
+#include "iter.h"
+
+void block_insert_before(struct block *blk, struct block *pos);
+void block_append(struct block *blk, struct list_head *head);
+void block_remove(struct block *blk);
+void block_counts_changed(struct block *blk);
+long block_start_offset(const struct block *blk);
+long block_start_line(const struct block *blk);
+long block_tree_size(struct list_head *head);
+struct block *block_find_offset(struct list_head *head, long *offset);
+struct block *block_find_line(struct list_head *head, long *line);
+void block_tree_check(struct list_head *head);
+
+#endif
@@ -1,64 +1,218 @@
 #include "block.h"
+#include "block-tree.h"
+#include "block-pool.h"
+#include "newline.h"
 #include "buffer.h"
 #include "view.h"
 #include "hl.h"
+#include "gbuf.h"
+
+#include <sys/mman.h>
 
 #define BLOCK_EDIT_SIZE 512
 
+// compacted blocks are as big as blocks created when loading a file
+#define BLOCK_COMPACT_SIZE 8192
+
 static void sanity_check(void)
 {
 	struct block *blk;
 	bool cursor_seen = false;
+	long mapped = 0, mapped_bytes = 0;
 
 	if (!DEBUG)
 		return;
 
 	BUG_ON(list_empty(&buffer->blocks));
+	BUG_ON(view->cursor.offset > view->cursor.blk->size);
+
+	// walking all blocks would make editing O(n)
+	if (DEBUG <= 2)
+		return;
 
 	list_for_each_entry(blk, &buffer->blocks, node) {
 		BUG_ON(!blk->size && buffer->blocks.next->next != &buffer->blocks);
-		BUG_ON(blk->size > blk->alloc);
+		BUG_ON(blk->alloc && blk->size > blk->alloc);
 		BUG_ON(blk->size && blk->data[blk->size - 1] != '\n');
 		if (blk == view->cursor.blk)
 			cursor_seen = true;
-		if (DEBUG > 2)
-			BUG_ON(count_nl(blk->data, blk->size) != blk->nl);
+		BUG_ON(!blk->uncounted && count_nl(blk->data, blk->size) != blk->nl);
+		if (!blk->alloc) {
+			mapped++;
+			mapped_bytes += blk->size;
+		}
 	}
 	BUG_ON(!cursor_seen);
-	BUG_ON(view->cursor.offset > view->cursor.blk->size);
+	BUG_ON(mapped != buffer->pool.stats.mapped);
+	BUG_ON(mapped_bytes != buffer->pool.stats.mapped_bytes);
+	block_tree_check(&buffer->blocks);
+}
+
+struct block *block_new(struct buffer *b, long alloc)
+{
+	struct block *blk = block_pool_get_block(&b->pool);
+
+	blk->data = block_pool_get_data(&b->pool, &alloc);
+	blk->alloc = alloc;
+	return blk;
 }
 
-static inline size_t ALLOC_ROUND(size_t size)
+// data points to b->map, see struct block
+struct block *block_new_mapped(struct buffer *b, unsigned char *data, long size)
 {
-	return ROUND_UP(size, 64);
+	struct block *blk = block_pool_get_block(&b->pool);
+
+	blk->data = data;
+	blk->size = size;
+	blk->nl = count_nl((const char *)data, size);
+	b->pool.stats.mapped++;
+	b->pool.stats.mapped_bytes += size;
+	return blk;
 }
 
-struct block *block_new(long alloc)
+// mapped block whose lines have not been counted, nl is an estimate
+struct block *block_new_uncounted(struct buffer *b, unsigned char *data, long size, long nl)
 {
-	struct block *blk = xnew0(struct block, 1);
+	struct block *blk = block_pool_get_block(&b->pool);
 
-	alloc = ALLOC_ROUND(alloc);
-	blk->data = xnew(char, alloc);
-	blk->alloc = alloc;
+	blk->data = data;
+	blk->size = size;
+	blk->nl = nl;
+	blk->uncounted = true;
+	b->pool.stats.mapped++;
+	b->pool.stats.mapped_bytes += size;
 	return blk;
 }
 
+static void unmap_file(struct buffer *b)
+{
+	munmap(b->map, b->map_size);
+	close(b->map_fd);
+	b->map = NULL;
+}
+
+static void unref_mapping(struct buffer *b, struct block *blk)
+{
+	b->pool.stats.mapped--;
+	b->pool.stats.mapped_bytes -= blk->size;
+	if (!b->pool.stats.mapped && !buffer_loading(b))
+		unmap_file(b);
+}
+
+// make room for at least size bytes
+void block_grow(struct buffer *b, struct block *blk, long size)
+{
+	if (!blk->alloc) {
+		// copy on write
+		unsigned char *data = block_pool_get_data(&b->pool, &size);
+
+		memcpy(data, blk->data, blk->size);
+		unref_mapping(b, blk);
+		blk->data = data;
+		blk->alloc = size;
+		return;
+	}
+	blk->data = block_pool_grow_data(&b->pool, blk->data, blk->size, &blk->alloc, size);
+}
+
+// must be called after contents of a block in the tree has changed
+static void block_changed(struct block *blk)
+{
+	free_line_starts(blk);
+	block_counts_changed(blk);
+}
+
+static void free_block(struct buffer *b, struct block *blk)
+{
+	free_line_starts(blk);
+	block_remove(blk);
+	if (blk->alloc) {
+		block_pool_put_data(&b->pool, blk->data, blk->alloc);
+	} else {
+		unref_mapping(b, blk);
+	}
+	block_pool_put_block(&b->pool, blk);
+}
+
 static void delete_block(struct block *blk)
 {
-	list_del(&blk->node);
-	free(blk->data);
-	free(blk);
+	free_block(buffer, blk);
 }
 
-static long copy_count_nl(char *dst, const char *src, long len)
+// free all blocks of a buffer at once
+void free_blocks(struct buffer *b)
 {
-	long i, nl = 0;
-	for (i = 0; i < len; i++) {
-		dst[i] = src[i];
-		if (src[i] == '\n')
-			nl++;
+	struct block *blk;
+
+	list_for_each_entry(blk, &b->blocks, node) {
+		free_line_starts(blk);
+		if (blk->alloc > BLOCK_POOL_MAX_DATA)
+			free(blk->data);
 	}
-	return nl;
+	if (b->map)
+		unmap_file(b);
+	block_pool_reset(&b->pool);
+	list_init(&b->blocks);
+}
+
+// copy all mapped blocks so that the file can be modified safely
+void unmap_blocks(struct buffer *b)
+{
+	struct block *blk;
+
+	list_for_each_entry(blk, &b->blocks, node) {
+		if (!b->map)
+			return;
+		if (!blk->alloc)
+			block_grow(b, blk, blk->size);
+	}
+	// all mapped blocks were edited before loading finished
+	if (b->map && !buffer_loading(b))
+		unmap_file(b);
+}
+
+/*
+ * Cut mapped block of a file that has changed on disk to the whole lines
+ * in its first avail bytes. The rest is not in the file anymore and
+ * reading it would raise SIGBUS. The block is freed if no line is left.
+ */
+void block_trim_mapped(struct buffer *b, struct block *blk, long avail)
+{
+	long size = avail < blk->size ? avail : blk->size;
+
+	// contents may have been rewritten, lines are counted again
+	b->nl -= blk->nl;
+	while (size > 0 && blk->data[size - 1] != '\n')
+		size--;
+	if (size <= 0) {
+		free_block(b, blk);
+		return;
+	}
+	b->pool.stats.mapped_bytes -= blk->size - size;
+	blk->size = size;
+	blk->nl = count_nl((const char *)blk->data, size);
+	blk->uncounted = false;
+	b->nl += blk->nl;
+	block_changed(blk);
+}
+
+/*
+ * Cut uncounted block to its first size bytes, estimated to have nl
+ * lines. The rest has been counted to other blocks. The block is freed if
+ * size is zero.
+ */
+void block_cut_uncounted(struct buffer *b, struct block *blk, long size, long nl)
+{
+	b->nl -= blk->nl;
+	if (!size) {
+		free_block(b, blk);
+		return;
+	}
+	b->pool.stats.mapped_bytes -= blk->size - size;
+	blk->size = size;
+	blk->nl = nl;
+	b->nl += nl;
+	block_changed(blk);
 }
 
 static long insert_to_current(const char *buf, long len)
@@ -68,14 +222,13 @@ static long insert_to_current(const char *buf, long len)
 	long size = blk->size + len;
 	long nl;
 
-	if (size > blk->alloc) {
-		blk->alloc = ALLOC_ROUND(size);
-		xrenew(blk->data, blk->alloc);
-	}
+	if (size > blk->alloc)
+		block_grow(buffer, blk, size);
 	memmove(blk->data + offset + len, blk->data + offset, blk->size - offset);
 	nl = copy_count_nl(blk->data + offset, buf, len);
 	blk->nl += nl;
 	blk->size = size;
+	block_changed(blk);
 	return nl;
 }
 
@@ -157,7 +310,7 @@ static long split_and_insert(const char *buf, long len)
 		}
 
 		BUG_ON(!size);
-		new = block_new(size);
+		new = block_new(buffer, size);
 		if (start < size1) {
 			long avail = size1 - start;
 			long count = size;
@@ -192,7 +345,7 @@ static long split_and_insert(const char *buf, long len)
 
 		new->size = size;
 		BUG_ON(copied != size);
-		list_add_before(&new->node, &blk->node);
+		block_insert_before(new, blk);
 
 		nl_added += new->nl;
 		size = 0;
@@ -233,12 +386,16 @@ static long insert_bytes(const char *buf, long len)
 
 void do_insert(const char *buf, long len)
 {
-	long nl = insert_bytes(buf, len);
+	long nl;
+
+	// cursor does not move, view->cy stays valid
+	view_update_cursor_y(view);
+	nl = insert_bytes(buf, len);
 
 	buffer->nl += nl;
+	view_cursor_edited(view);
 	sanity_check();
 
-	view_update_cursor_y(view);
 	buffer_mark_lines_changed(view->buffer, view->cy, nl ? INT_MAX : view->cy);
 	if (buffer->syn)
 		hl_insert(buffer, view->cy, nl);
@@ -261,6 +418,7 @@ char *do_delete(long len)
 	if (!len)
 		return NULL;
 
+	view_update_cursor_y(view);
 	if (!offset) {
 		// the block where cursor is can become empty and thereby may be deleted
 		saved_prev_node = blk->node.prev;
@@ -275,6 +433,14 @@ char *do_delete(long len)
 
 		if (count > avail)
 			count = avail;
+		if (!blk->alloc) {
+			if (count < avail) {
+				block_grow(buffer, blk, blk->size);
+			} else {
+				// truncating does not need a copy
+				buffer->pool.stats.mapped_bytes -= count;
+			}
+		}
 		nl = copy_count_nl(buf + pos, blk->data + offset, count);
 		if (count < avail)
 			memmove(blk->data + offset, blk->data + offset + count, avail - count);
@@ -283,8 +449,11 @@ char *do_delete(long len)
 		buffer->nl -= nl;
 		blk->nl -= nl;
 		blk->size -= count;
-		if (!blk->size && !only_block(blk))
+		if (!blk->size && !only_block(blk)) {
 			delete_block(blk);
+		} else {
+			block_changed(blk);
+		}
 
 		offset = 0;
 		pos += count;
@@ -308,25 +477,98 @@ char *do_delete(long len)
 		struct block *next = BLOCK(blk->node.next);
 		long size = blk->size + next->size;
 
-		if (size > blk->alloc) {
-			blk->alloc = ALLOC_ROUND(size);
-			xrenew(blk->data, blk->alloc);
-		}
+		if (size > blk->alloc)
+			block_grow(buffer, blk, size);
 		memcpy(blk->data + blk->size, next->data, next->size);
 		blk->size = size;
 		blk->nl += next->nl;
 		delete_block(next);
+		block_changed(blk);
 	}
 
+	view_cursor_edited(view);
 	sanity_check();
 
-	view_update_cursor_y(view);
 	buffer_mark_lines_changed(view->buffer, view->cy, deleted_nl ? INT_MAX : view->cy);
 	if (buffer->syn)
 		hl_delete(buffer, view->cy, deleted_nl);
 	return buf;
 }
 
+// average block is less than quarter full
+bool blocks_fragmented(struct buffer *b)
+{
+	long blocks = b->pool.stats.blocks;
+
+	if (blocks < b->compacted_blocks + 64)
+		return false;
+	return block_tree_size(&b->blocks) / blocks < BLOCK_COMPACT_SIZE / 4;
+}
+
+// append next to blk and free next
+static void merge_blocks(struct buffer *b, struct block *blk, struct block *next)
+{
+	long size = blk->size + next->size;
+	long i;
+
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		if (v->cursor.blk == next) {
+			v->cursor.blk = blk;
+			v->cursor.offset += blk->size;
+		}
+		if (v->pos_blk == next)
+			v->pos_blk = NULL;
+	}
+
+	if (b->syn)
+		hl_merge_blocks(b, next);
+	if (size > blk->alloc)
+		block_grow(b, blk, size);
+	memcpy(blk->data + blk->size, next->data, next->size);
+	blk->size = size;
+	blk->nl += next->nl;
+	free_block(b, next);
+	block_changed(blk);
+}
+
+/*
+ * Merge adjacent small blocks after heavy editing has left lots of tiny
+ * blocks. Continues from b->compact_pos and visits at most max blocks.
+ *
+ * Absolute positions do not change. Cursors of views are moved to the
+ * merged blocks.
+ *
+ * Returns true if there is still something left to compact.
+ */
+bool compact_blocks(struct buffer *b, long max)
+{
+	long offset = b->compact_pos;
+	struct block *blk = block_find_offset(&b->blocks, &offset);
+
+	if (!blk)
+		blk = BLOCK(b->blocks.next);
+
+	while (max-- > 0) {
+		struct block *next;
+
+		if (blk->node.next == &b->blocks) {
+			b->compact_pos = 0;
+			b->compacted_blocks = b->pool.stats.blocks;
+			return false;
+		}
+		next = BLOCK(blk->node.next);
+		if (blk->size + next->size <= BLOCK_COMPACT_SIZE) {
+			merge_blocks(b, blk, next);
+		} else {
+			blk = next;
+		}
+	}
+	b->compact_pos = block_start_offset(blk);
+	return true;
+}
+
 char *do_replace(long del, const char *buf, long ins)
 {
 	struct block *blk;
@@ -334,6 +576,7 @@ char *do_replace(long del, const char *buf, long ins)
 	char *ptr, *deleted;
 	long del_nl, ins_nl;
 
+	view_update_cursor_y(view);
 	block_iter_normalize(&view->cursor);
 	blk = view->cursor.blk;
 	offset = view->cursor.offset;
@@ -351,10 +594,8 @@ char *do_replace(long del, const char *buf, long ins)
 		}
 	}
 
-	if (new_size > blk->alloc) {
-		blk->alloc = ALLOC_ROUND(new_size);
-		xrenew(blk->data, blk->alloc);
-	}
+	if (new_size > blk->alloc)
+		block_grow(buffer, blk, new_size);
 
 	// modification is limited to one block
 	ptr = blk->data + offset;
@@ -370,10 +611,11 @@ char *do_replace(long del, const char *buf, long ins)
 	blk->nl += ins_nl;
 	buffer->nl += ins_nl;
 	blk->size = new_size;
+	block_changed(blk);
 
+	view_cursor_edited(view);
 	sanity_check();
 
-	view_update_cursor_y(view);
 	if (del_nl == ins_nl) {
 		// some line(s) changed but lines after them did not move up or down
 		buffer_mark_lines_changed(view->buffer, view->cy, view->cy + del_nl);
@@ -386,7 +628,204 @@ char *do_replace(long del, const char *buf, long ins)
 	}
 	return deleted;
 slow:
+	if (del + ins > 4 * BLOCK_COMPACT_SIZE) {
+		// big replace, for example undo of :replace
+		struct bulk_edit e = { view_get_cursor_offset(view), del, ins, buf, NULL };
+
+		do_bulk_replace(&e, 1);
+		return e.deleted;
+	}
 	deleted = do_delete(del);
 	do_insert(buf, ins);
 	return deleted;
 }
+
+// blocks are added before pos, out keeps its last incomplete line unless all
+static void add_bulk_blocks(struct gbuf *out, struct list_head *pos, bool all)
+{
+	long start = 0;
+	long end = out->len;
+
+	if (!all) {
+		while (end > 0 && out->buffer[end - 1] != '\n')
+			end--;
+	}
+	while (start < end) {
+		const unsigned char *data = out->buffer + start;
+		long size = end - start;
+		struct block *blk;
+
+		if (size > BLOCK_COMPACT_SIZE) {
+			// cut after last newline that fits, or after first one
+			long i = BLOCK_COMPACT_SIZE;
+
+			while (i > 0 && data[i - 1] != '\n')
+				i--;
+			if (!i) {
+				const unsigned char *nl = memchr(data, '\n', size);
+				if (nl)
+					i = nl - data + 1;
+			}
+			if (i)
+				size = i;
+		}
+		blk = block_new(buffer, size);
+		blk->nl = copy_count_nl(blk->data, data, size);
+		blk->size = size;
+		if (pos == &buffer->blocks) {
+			block_append(blk, pos);
+		} else {
+			block_insert_before(blk, BLOCK(pos));
+		}
+		start += size;
+	}
+	gbuf_remove(out, 0, end);
+}
+
+// read count bytes to dst freeing blocks that have been read completely
+static long bulk_read(struct block_iter *bi, char *dst, long count)
+{
+	long nl = 0;
+
+	while (count) {
+		long n = bi->blk->size - bi->offset;
+
+		if (!n) {
+			struct block *next = BLOCK(bi->blk->node.next);
+
+			free_block(buffer, bi->blk);
+			bi->blk = next;
+			bi->offset = 0;
+			continue;
+		}
+		if (n > count)
+			n = count;
+		nl += copy_count_nl(dst, (const char *)bi->blk->data + bi->offset, n);
+		bi->offset += n;
+		dst += n;
+		count -= n;
+	}
+	return nl;
+}
+
+static long bulk_copy(struct block_iter *bi, struct gbuf *out, long count)
+{
+	long nl;
+
+	gbuf_grow(out, count);
+	nl = bulk_read(bi, (char *)out->buffer + out->len, count);
+	out->len += count;
+	if (out->len >= 4 * BLOCK_COMPACT_SIZE)
+		add_bulk_blocks(out, &bi->blk->node, false);
+	return nl;
+}
+
+/*
+ * Replace many ranges in one pass. Edits must be sorted by offset and
+ * must not overlap. Offsets are relative to the buffer before any of the
+ * edits. Deleted bytes are returned in edits[i].deleted.
+ *
+ * Blocks between edits are kept as is, only blocks containing edited text
+ * are rebuilt. Highlighter and changed lines are updated once for the
+ * whole range. Cursor is left at beginning of the first edit.
+ */
+void do_bulk_replace(struct bulk_edit *edits, long count)
+{
+	struct block_iter bi;
+	struct list_head *pos;
+	GBUF(out);
+	long first = edits[0].offset;
+	long prev_end = first;
+	long old_nl = 0, new_nl = 0;
+	long i;
+
+	block_iter_goto_offset(&view->cursor, first);
+	block_iter_normalize(&view->cursor);
+	view_update_cursor_y(view);
+
+	// the first block is rebuilt from its beginning
+	bi = view->cursor;
+	gbuf_add_buf(&out, (const char *)bi.blk->data, bi.offset);
+
+	for (i = 0; i < count; i++) {
+		struct bulk_edit *e = &edits[i];
+		long gap = e->offset - prev_end;
+
+		BUG_ON(gap < 0);
+		while (gap) {
+			struct block *blk = bi.blk;
+			long n, nl;
+
+			if (!bi.offset && gap >= blk->size && blk->node.next != &buffer->blocks &&
+			    (!out.len || out.buffer[out.len - 1] == '\n')) {
+				// whole block is unchanged
+				add_bulk_blocks(&out, &blk->node, true);
+				old_nl += blk->nl;
+				new_nl += blk->nl;
+				gap -= blk->size;
+				bi.blk = BLOCK(blk->node.next);
+				continue;
+			}
+			n = blk->size - bi.offset;
+			if (!n) {
+				bi.blk = BLOCK(blk->node.next);
+				bi.offset = 0;
+				free_block(buffer, blk);
+				continue;
+			}
+			if (n > gap)
+				n = gap;
+			nl = bulk_copy(&bi, &out, n);
+			old_nl += nl;
+			new_nl += nl;
+			gap -= n;
+		}
+
+		e->deleted = NULL;
+		if (e->del) {
+			e->deleted = xmalloc(e->del);
+			old_nl += bulk_read(&bi, e->deleted, e->del);
+		}
+		if (e->ins) {
+			gbuf_add_buf(&out, e->buf, e->ins);
+			new_nl += count_nl(e->buf, e->ins);
+		}
+		prev_end = e->offset + e->del;
+	}
+
+	// rest of the last block, lines must not be split between blocks
+	while (1) {
+		struct block *blk = bi.blk;
+		long n = blk->size - bi.offset;
+
+		gbuf_add_buf(&out, (const char *)blk->data + bi.offset, n);
+		pos = blk->node.next;
+		free_block(buffer, blk);
+		if (pos == &buffer->blocks || (out.len && out.buffer[out.len - 1] == '\n'))
+			break;
+		bi.blk = BLOCK(pos);
+		bi.offset = 0;
+	}
+	add_bulk_blocks(&out, pos, true);
+	gbuf_free(&out);
+
+	// at least one block required
+	if (list_empty(&buffer->blocks))
+		block_append(block_new(buffer, 1), &buffer->blocks);
+	buffer->nl += new_nl - old_nl;
+
+	view->cursor.blk = BLOCK(buffer->blocks.next);
+	block_iter_goto_offset(&view->cursor, first);
+	view_cursor_edited(view);
+	sanity_check();
+
+	if (old_nl == new_nl) {
+		buffer_mark_lines_changed(view->buffer, view->cy, view->cy + old_nl);
+	} else {
+		buffer_mark_lines_changed(view->buffer, view->cy, INT_MAX);
+	}
+	if (buffer->syn) {
+		hl_delete(buffer, view->cy, old_nl);
+		hl_insert(buffer, view->cy, new_nl);
+	}
+}
@@ -1,9 +1,31 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
-struct block *block_new(long size);
+#include "libc.h"
+
+struct buffer;
+
+struct bulk_edit {
+	long offset;
+	long del;
+	long ins;
+	const char *buf;
+	char *deleted;
+};
+
+struct block *block_new(struct buffer *b, long size);
+struct block *block_new_mapped(struct buffer *b, unsigned char *data, long size);
+struct block *block_new_uncounted(struct buffer *b, unsigned char *data, long size, long nl);
+void block_grow(struct buffer *b, struct block *blk, long size);
+void free_blocks(struct buffer *b);
+void unmap_blocks(struct buffer *b);
+void block_trim_mapped(struct buffer *b, struct block *blk, long avail);
+void block_cut_uncounted(struct buffer *b, struct block *blk, long size, long nl);
+bool blocks_fragmented(struct buffer *b);
+bool compact_blocks(struct buffer *b, long max);
 void do_insert(const char *buf, long len);
 char *do_delete(long len);
 char *do_replace(long del, const char *buf, long ins);
+void do_bulk_replace(struct bulk_edit *edits, long count);
 
 #endif
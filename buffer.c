@@ -3,9 +3,11 @@
 #include "editor.h"
 #include "change.h"
 #include "block.h"
+#include "block-tree.h"
 #include "filetype.h"
 #include "state.h"
 #include "syntax.h"
+#include "hl.h"
 #include "file-option.h"
 #include "lock.h"
 #include "selection.h"
@@ -13,6 +15,8 @@
 #include "unicode.h"
 #include "uchar.h"
 #include "detect.h"
+#include "journal.h"
+#include "undo-file.h"
 
 struct buffer *buffer;
 PTR_ARRAY(buffers);
@@ -80,8 +84,8 @@ struct buffer *open_empty_buffer(void)
 	struct block *blk;
 
 	// at least one block required
-	blk = block_new(1);
-	list_add_before(&blk->node, &b->blocks);
+	blk = block_new(b, 1);
+	block_append(blk, &b->blocks);
 
 	set_display_filename(b, xstrdup("(No name)"));
 	return b;
@@ -89,24 +93,18 @@ struct buffer *open_empty_buffer(void)
 
 void free_buffer(struct buffer *b)
 {
-	struct list_head *item;
-
 	ptr_array_remove(&buffers, b);
 
 	if (b->locked)
 		unlock_file(b->abs_filename);
 
-	item = b->blocks.next;
-	while (item != &b->blocks) {
-		struct list_head *next = item->next;
-		struct block *blk = BLOCK(item);
-
-		free(blk->data);
-		free(blk);
-		item = next;
-	}
+	save_undo_history(b);
+	journal_remove(b);
+	free_blocks(b);
 	free_changes(&b->change_head);
+	free_undo_history(b);
 	free(b->line_start_states.ptrs);
+	free(b->uncounted.ptrs);
 	free(b->views.ptrs);
 	free(b->display_filename);
 	free(b->abs_filename);
@@ -205,16 +203,7 @@ void buffer_update_syntax(struct buffer *b)
 		return;
 
 	b->syn = syn;
-	if (syn) {
-		// start state of first line is constant
-		struct ptr_array *s = &b->line_start_states;
-		if (!s->alloc) {
-			s->alloc = 64;
-			s->ptrs = xnew(void *, s->alloc);
-		}
-		s->ptrs[0] = syn->states.ptrs[0];
-		s->count = 1;
-	}
+	hl_reset(b);
 
 	mark_all_lines_changed(b);
 }
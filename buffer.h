@@ -6,6 +6,7 @@
 #include "options.h"
 #include "common.h"
 #include "ptr-array.h"
+#include "block-pool.h"
 
 struct change {
 	struct change *next;
@@ -15,22 +16,62 @@ struct change {
 	// move after inserted text when undoing delete?
 	bool move_after;
 
+	// deleted bytes are in undo history file mapping, see undo-file.c
+	bool persisted;
+
 	long offset;
 	long del_count;
 	long ins_count;
 
 	// deleted bytes (inserted bytes need not to be saved)
 	char *buf;
+
+	// offset of the deleted bytes in the spill file or in the mapping
+	// of the undo history file if buf is NULL
+	long spill_offset;
 };
 
 struct buffer {
 	struct list_head blocks;
+	struct block_pool pool;
+
+	// file mapping used by blocks whose alloc is zero
+	unsigned char *map;
+	size_t map_size;
+	// bytes of the mapping added to blocks, see load_more()
+	size_t map_loaded;
+	// mapped bytes are all ASCII so far, encoding is not certain yet
+	bool map_ascii;
+	// uncounted blocks in order, see load_line()
+	struct ptr_array uncounted;
+	// mapped file is checked for changes before blocks are read, see
+	// mapping_changed()
+	int map_fd;
+	off_t map_file_size;
+	time_t map_mtime;
+
 	struct change change_head;
 	struct change *cur_change;
 
 	// used to determine if buffer is modified
 	struct change *saved_change;
 
+	// deleted bytes of changes in memory and in the spill file
+	long undo_bytes;
+	long undo_spilled;
+
+	// crash recovery journal, NULL until first edit
+	struct journal *journal;
+
+	// undo history saved by previous session, decoded when first needed
+	unsigned char *undo_map;
+	size_t undo_map_size;
+	bool undo_pending;
+	// hash of the contents loaded so far, see hash_loaded_blocks()
+	unsigned long long undo_hash;
+	// bytes of the mapping hashed so far, see hash_skipped()
+	size_t undo_hashed;
+
 	struct stat st;
 
 	// needed for identifying buffers whose filename is NULL
@@ -56,12 +97,24 @@ struct buffer {
 	struct local_options options;
 
 	struct syntax *syn;
-	// Index 0 is always syn->states.ptrs[0].
+	// Start states of lines hl_first, hl_first + 1, ... Only lines near
+	// the view are kept, other start states are found from block
+	// checkpoints (struct block hl_start).
 	// Lowest bit of an invalidated value is 1.
 	struct ptr_array line_start_states;
+	int hl_first;
+	// hl_start of blocks starting before this line is valid
+	int hl_valid;
+	// start states up to this line are still being computed in the
+	// background, 0 if none, see hl_fill_start_states()
+	int hl_goal;
 
 	int changed_line_min;
 	int changed_line_max;
+
+	// see compact_blocks()
+	long compact_pos;
+	long compacted_blocks;
 };
 
 // buffer = view->buffer = window->view->buffer
@@ -70,6 +123,12 @@ extern struct buffer *buffer;
 extern struct ptr_array buffers;
 extern bool everything_changed;
 
+// end of a big file is not in the buffer yet or lines are not counted
+static inline bool buffer_loading(struct buffer *b)
+{
+	return b->map_loaded < b->map_size || b->uncounted.count;
+}
+
 static inline void mark_all_lines_changed(struct buffer *b)
 {
 	b->changed_line_min = 0;
@@ -3,6 +3,13 @@
 #include "error.h"
 #include "block.h"
 #include "view.h"
+#include "editor.h"
+#include "options.h"
+#include "gbuf.h"
+#include "ptr-array.h"
+#include "journal.h"
+#include "undo-file.h"
+#include "load-save.h"
 
 static enum change_merge change_merge;
 static enum change_merge prev_change_merge;
@@ -54,9 +61,203 @@ static struct change *new_change(void)
 	return change;
 }
 
+/*
+ * Deleted bytes of old changes are moved to a spill file when the undo
+ * history of a buffer uses more than undo-memory-size megabytes. The file
+ * is shared by all buffers, only appended to and unlinked right after it
+ * has been created.
+ */
+#define SPILL_BATCH (1L << 20)
+
+static int spill_fd = -1;
+static bool spill_failed;
+
+// bytes written to the spill file and bytes still referenced by changes
+static long spill_size;
+static long spill_live;
+
+static bool is_spilled(const struct change *change)
+{
+	return change->del_count && !change->buf;
+}
+
+static bool open_spill_file(void)
+{
+	char *filename;
+
+	if (spill_failed)
+		return false;
+	if (spill_fd >= 0)
+		return true;
+
+	filename = editor_file("undo-XXXXXX");
+	spill_fd = mkstemp(filename);
+	if (spill_fd < 0) {
+		error_msg("Error creating undo spill file: %s", strerror(errno));
+		spill_failed = true;
+	} else {
+		unlink(filename);
+		fcntl(spill_fd, F_SETFD, FD_CLOEXEC);
+	}
+	free(filename);
+	return !spill_failed;
+}
+
+static bool spill_write(const char *buf, long count)
+{
+	if (lseek(spill_fd, spill_size, SEEK_SET) < 0 || xwrite(spill_fd, buf, count) < 0) {
+		error_msg("Error writing undo spill file: %s", strerror(errno));
+		spill_failed = true;
+		return false;
+	}
+	spill_size += count;
+	return true;
+}
+
+static void release_spilled(long count)
+{
+	spill_live -= count;
+	if (!spill_live && spill_size && !ftruncate(spill_fd, 0))
+		spill_size = 0;
+}
+
+static void drop_payload(struct change *change)
+{
+	free(change->buf);
+	change->buf = NULL;
+	buffer->undo_bytes -= change->del_count;
+	buffer->undo_spilled += change->del_count;
+	spill_live += change->del_count;
+}
+
+static void flush_spilled(struct gbuf *batch, struct ptr_array *pending)
+{
+	long i;
+
+	if (pending->count && spill_write((char *)batch->buffer, batch->len)) {
+		for (i = 0; i < pending->count; i++)
+			drop_payload(pending->ptrs[i]);
+	}
+	gbuf_clear(batch);
+	pending->count = 0;
+}
+
+static void limit_undo_memory(void)
+{
+	long limit = options.undo_memory_size * 1024L * 1024L;
+	PTR_ARRAY(stack);
+	PTR_ARRAY(pending);
+	GBUF(batch);
+	long bytes;
+
+	if (!limit || buffer->undo_bytes <= limit || !open_spill_file())
+		return;
+
+	// leave some room so that the next few changes won't spill again
+	limit -= limit / 4;
+	bytes = buffer->undo_bytes;
+
+	// oldest changes first
+	ptr_array_add(&stack, &buffer->change_head);
+	while (stack.count && bytes > limit && !spill_failed) {
+		struct change *change = ptr_array_remove_idx(&stack, stack.count - 1);
+		long i;
+
+		for (i = change->nr_prev; i > 0; i--)
+			ptr_array_add(&stack, change->prev[i - 1]);
+
+		// the current change can still be merged to
+		if (!change->buf || change == buffer->cur_change)
+			continue;
+
+		bytes -= change->del_count;
+		if (change->del_count >= SPILL_BATCH) {
+			flush_spilled(&batch, &pending);
+			change->spill_offset = spill_size;
+			if (!spill_failed && spill_write(change->buf, change->del_count))
+				drop_payload(change);
+		} else {
+			change->spill_offset = spill_size + batch.len;
+			gbuf_add_buf(&batch, change->buf, change->del_count);
+			ptr_array_add(&pending, change);
+			if (batch.len >= SPILL_BATCH)
+				flush_spilled(&batch, &pending);
+		}
+	}
+	flush_spilled(&batch, &pending);
+	gbuf_free(&batch);
+	free(pending.ptrs);
+	free(stack.ptrs);
+}
+
+// returns copy of deleted bytes of a change whose buf is NULL
+char *read_change_payload(struct buffer *b, const struct change *change)
+{
+	long count = change->del_count;
+	char *buf = xnew(char, count);
+
+	if (change->persisted) {
+		memcpy(buf, b->undo_map + change->spill_offset, count);
+		return buf;
+	}
+	if (lseek(spill_fd, change->spill_offset, SEEK_SET) < 0 || xread(spill_fd, buf, count) != count) {
+		error_msg("Error reading undo spill file: %s", strerror(errno));
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static bool page_in(struct change *change)
+{
+	long count = change->del_count;
+	char *buf;
+
+	if (!is_spilled(change))
+		return true;
+
+	buf = read_change_payload(buffer, change);
+	if (!buf)
+		return false;
+	change->buf = buf;
+	buffer->undo_bytes += count;
+	if (change->persisted) {
+		change->persisted = false;
+	} else {
+		buffer->undo_spilled -= count;
+		release_spilled(count);
+	}
+	return true;
+}
+
+void get_undo_stats(struct undo_stats *s)
+{
+	PTR_ARRAY(stack);
+
+	if (buffer->undo_pending)
+		decode_undo_history(buffer);
+	clear(s);
+	ptr_array_add(&stack, &buffer->change_head);
+	while (stack.count) {
+		struct change *change = ptr_array_remove_idx(&stack, stack.count - 1);
+		unsigned int i;
+
+		for (i = 0; i < change->nr_prev; i++)
+			ptr_array_add(&stack, change->prev[i]);
+		s->changes++;
+	}
+	free(stack.ptrs);
+
+	// change_head is not a real change
+	s->changes--;
+	s->memory = buffer->undo_bytes;
+	s->spilled = buffer->undo_spilled;
+	s->spill_file = spill_size;
+}
+
 static long buffer_offset(void)
 {
-	return block_iter_get_offset(&view->cursor);
+	return view_get_cursor_offset(view);
 }
 
 static void record_insert(long len)
@@ -86,6 +287,7 @@ static void record_delete(char *buf, long len, bool move_after)
 			xrenew(change->buf, change->del_count + len);
 			memcpy(change->buf + change->del_count, buf, len);
 			change->del_count += len;
+			buffer->undo_bytes += len;
 			free(buf);
 			return;
 		}
@@ -93,6 +295,7 @@ static void record_delete(char *buf, long len, bool move_after)
 			xrenew(buf, len + change->del_count);
 			memcpy(buf + len, change->buf, change->del_count);
 			change->del_count += len;
+			buffer->undo_bytes += len;
 			free(change->buf);
 			change->buf = buf;
 			change->offset -= len;
@@ -105,6 +308,7 @@ static void record_delete(char *buf, long len, bool move_after)
 	change->del_count = len;
 	change->move_after = move_after;
 	change->buf = buf;
+	buffer->undo_bytes += len;
 }
 
 static void record_replace(char *deleted, long del_count, long ins_count)
@@ -120,6 +324,7 @@ static void record_replace(char *deleted, long del_count, long ins_count)
 	change->ins_count = ins_count;
 	change->del_count = del_count;
 	change->buf = deleted;
+	buffer->undo_bytes += del_count;
 }
 
 void begin_change(enum change_merge m)
@@ -174,12 +379,30 @@ static void fix_cursors(long offset, long del, long ins)
 	}
 }
 
+// uncounted lines are counted before they are edited, see load_line()
+static void before_edit(long len)
+{
+	if (buffer->uncounted.count)
+		count_lines(buffer, block_iter_get_offset(&view->cursor), len);
+}
+
+static void before_bulk_edit(const struct bulk_edit *edits, long count)
+{
+	const struct bulk_edit *last = &edits[count - 1];
+
+	if (buffer->uncounted.count)
+		count_lines(buffer, edits[0].offset, last->offset + last->del - edits[0].offset);
+}
+
 static void reverse_change(struct change *change)
 {
+	journal_edit(buffer, change->offset, change->ins_count, change->buf, change->del_count);
+	buffer->undo_bytes -= change->del_count;
 	if (buffer->views.count > 1)
 		fix_cursors(change->offset, change->ins_count, change->del_count);
 
 	block_iter_goto_offset(&view->cursor, change->offset);
+	before_edit(change->ins_count);
 	if (!change->ins_count) {
 		// convert delete to insert
 		do_insert(change->buf, change->del_count);
@@ -205,38 +428,139 @@ static void reverse_change(struct change *change)
 		change->del_count = change->ins_count;
 		change->ins_count = 0;
 	}
+	buffer->undo_bytes += change->del_count;
+}
+
+/*
+ * Reversing the changes of a chain one by one walks the block tree and
+ * updates the highlighter for every change. Chains recorded by :replace
+ * and the like edit the buffer from top to bottom so the changes can be
+ * reversed in one pass over the blocks instead.
+ */
+#define BULK_CHAIN_MIN 16
+
+// changes are in the order they would be reversed one by one
+static void reverse_chain_bulk(struct ptr_array *chain, bool descending)
+{
+	long i, n = chain->count;
+	long delta = 0;
+	struct bulk_edit *edits = xnew(struct bulk_edit, n);
+	struct change *last = chain->ptrs[n - 1];
+	long cursor = last->offset;
+
+	if (!last->ins_count && last->move_after)
+		cursor += last->del_count;
+
+	// reversing a change deletes ins_count bytes and inserts del_count bytes
+	for (i = 0; i < n; i++) {
+		struct change *change = chain->ptrs[i];
+		struct bulk_edit *e = &edits[descending ? n - 1 - i : i];
+
+		e->offset = change->offset - delta;
+		e->del = change->ins_count;
+		e->ins = change->del_count;
+		e->buf = change->buf;
+		if (!descending)
+			delta += change->del_count - change->ins_count;
+		journal_edit(buffer, change->offset, change->ins_count, change->buf, change->del_count);
+		if (buffer->views.count > 1)
+			fix_cursors(change->offset, change->ins_count, change->del_count);
+	}
+
+	before_bulk_edit(edits, n);
+	do_bulk_replace(edits, n);
+
+	for (i = 0; i < n; i++) {
+		struct change *change = chain->ptrs[i];
+		struct bulk_edit *e = &edits[descending ? n - 1 - i : i];
+
+		buffer->undo_bytes += e->del - change->del_count;
+		free(change->buf);
+		change->buf = e->deleted;
+		change->del_count = e->del;
+		change->ins_count = e->ins;
+	}
+	free(edits);
+	block_iter_goto_offset(&view->cursor, cursor);
+}
+
+static bool reverse_chain(struct ptr_array *chain)
+{
+	bool descending = true;
+	bool ascending = true;
+	long i;
+
+	for (i = 0; i < chain->count; i++) {
+		if (!page_in(chain->ptrs[i]))
+			return false;
+	}
+
+	for (i = 1; i < chain->count; i++) {
+		struct change *a = chain->ptrs[i - 1];
+		struct change *b = chain->ptrs[i];
+
+		if (b->offset + b->ins_count > a->offset)
+			descending = false;
+		if (b->offset < a->offset + a->del_count)
+			ascending = false;
+	}
+
+	if (chain->count >= BULK_CHAIN_MIN && (descending || ascending)) {
+		reverse_chain_bulk(chain, descending);
+	} else {
+		for (i = 0; i < chain->count; i++)
+			reverse_change(chain->ptrs[i]);
+	}
+	return true;
 }
 
 bool undo(void)
 {
-	struct change *change = buffer->cur_change;
+	struct change *change;
+
+	// changes of this session don't need the saved history
+	if (buffer->undo_pending && buffer->cur_change == &buffer->change_head)
+		decode_undo_history(buffer);
+	change = buffer->cur_change;
 
 	view_reset_preferred_x(view);
 	if (!change->next)
 		return false;
 
 	if (is_change_chain_barrier(change)) {
-		int count = 0;
+		PTR_ARRAY(chain);
+		long count;
+		bool ok;
 
-		while (1) {
+		change = change->next;
+		while (!is_change_chain_barrier(change)) {
+			ptr_array_add(&chain, change);
 			change = change->next;
-			if (is_change_chain_barrier(change))
-				break;
-			reverse_change(change);
-			count++;
 		}
+		count = chain.count;
+		ok = reverse_chain(&chain);
+		free(chain.ptrs);
+		if (!ok)
+			return false;
 		if (count > 1)
-			info_msg("Undid %d changes.", count);
+			info_msg("Undid %ld changes.", count);
 	} else {
+		if (!page_in(change))
+			return false;
 		reverse_change(change);
 	}
 	buffer->cur_change = change->next;
+	limit_undo_memory();
 	return true;
 }
 
 bool redo(unsigned int change_id)
 {
-	struct change *change = buffer->cur_change;
+	struct change *change;
+
+	if (buffer->undo_pending && buffer->cur_change == &buffer->change_head)
+		decode_undo_history(buffer);
+	change = buffer->cur_change;
 
 	view_reset_preferred_x(view);
 	if (!change->prev) {
@@ -260,21 +584,29 @@ bool redo(unsigned int change_id)
 
 	change = change->prev[change_id];
 	if (is_change_chain_barrier(change)) {
-		int count = 0;
+		PTR_ARRAY(chain);
+		long count;
+		bool ok;
 
-		while (1) {
+		change = change->prev[change->nr_prev - 1];
+		while (!is_change_chain_barrier(change)) {
+			ptr_array_add(&chain, change);
 			change = change->prev[change->nr_prev - 1];
-			if (is_change_chain_barrier(change))
-				break;
-			reverse_change(change);
-			count++;
 		}
+		count = chain.count;
+		ok = reverse_chain(&chain);
+		free(chain.ptrs);
+		if (!ok)
+			return false;
 		if (count > 1)
-			info_msg("Redid %d changes.", count);
+			info_msg("Redid %ld changes.", count);
 	} else {
+		if (!page_in(change))
+			return false;
 		reverse_change(change);
 	}
 	buffer->cur_change = change;
+	limit_undo_memory();
 	return true;
 }
 
@@ -288,6 +620,8 @@ top:
 	while (ch->next) {
 		struct change *next = ch->next;
 
+		if (is_spilled(ch) && !ch->persisted)
+			release_spilled(ch->del_count);
 		free(ch->buf);
 		free(ch);
 
@@ -300,6 +634,37 @@ top:
 	}
 }
 
+// forget undo history whose offsets don't match contents of b anymore
+void reset_changes(struct buffer *b)
+{
+	free_changes(&b->change_head);
+	b->change_head.prev = NULL;
+	b->change_head.nr_prev = 0;
+	b->cur_change = &b->change_head;
+	// never equal to cur_change, buffer is modified
+	b->saved_change = NULL;
+	b->undo_bytes = 0;
+	b->undo_spilled = 0;
+	free_undo_history(b);
+	prev_change_merge = CHANGE_MERGE_NONE;
+}
+
+// apply edit read from journal, see journal_recover()
+void buffer_replay_edit(long offset, long del, const char *ins, long ins_count)
+{
+	block_iter_goto_offset(&view->cursor, offset);
+	before_edit(del);
+	if (!del) {
+		do_insert(ins, ins_count);
+		record_insert(ins_count);
+	} else if (!ins_count) {
+		record_delete(do_delete(del), del, false);
+	} else {
+		record_replace(do_replace(del, ins, ins_count), del, ins_count);
+	}
+	limit_undo_memory();
+}
+
 void buffer_insert_bytes(const char *buf, long len)
 {
 	long rec_len = len;
@@ -308,17 +673,20 @@ void buffer_insert_bytes(const char *buf, long len)
 	if (len == 0)
 		return;
 
+	before_edit(0);
 	if (buf[len - 1] != '\n' && block_iter_is_eof(&view->cursor)) {
 		// force newline at EOF
 		do_insert("\n", 1);
+		journal_edit(buffer, buffer_offset(), 0, "\n", 1);
 		rec_len++;
 	}
 
 	do_insert(buf, len);
+	journal_edit(buffer, buffer_offset(), 0, buf, len);
 	record_insert(rec_len);
 
 	if (buffer->views.count > 1)
-		fix_cursors(block_iter_get_offset(&view->cursor), len, 0);
+		fix_cursors(buffer_offset(), len, 0);
 }
 
 static bool would_delete_last_bytes(long count)
@@ -347,6 +715,7 @@ static void buffer_delete_bytes_internal(long len, bool move_after)
 	if (len == 0)
 		return;
 
+	before_edit(len);
 	// check if all newlines from EOF would be deleted
 	if (would_delete_last_bytes(len)) {
 		struct block_iter bi = view->cursor;
@@ -361,9 +730,11 @@ static void buffer_delete_bytes_internal(long len, bool move_after)
 		}
 	}
 	record_delete(do_delete(len), len, move_after);
+	journal_edit(buffer, buffer_offset(), len, NULL, 0);
+	limit_undo_memory();
 
 	if (buffer->views.count > 1)
-		fix_cursors(block_iter_get_offset(&view->cursor), len, 0);
+		fix_cursors(buffer_offset(), len, 0);
 }
 
 void buffer_delete_bytes(long len)
@@ -390,6 +761,7 @@ void buffer_replace_bytes(long del_count, const char *inserted, long ins_count)
 		return;
 	}
 
+	before_edit(del_count);
 	// check if all newlines from EOF would be deleted
 	if (would_delete_last_bytes(del_count)) {
 		if (inserted[ins_count - 1] != '\n') {
@@ -403,7 +775,60 @@ void buffer_replace_bytes(long del_count, const char *inserted, long ins_count)
 
 	deleted = do_replace(del_count, inserted, ins_count);
 	record_replace(deleted, del_count, ins_count);
+	journal_edit(buffer, buffer_offset(), del_count, inserted, ins_count);
+	limit_undo_memory();
+
+	if (buffer->views.count > 1)
+		fix_cursors(buffer_offset(), del_count, ins_count);
+}
+
+/*
+ * Apply many replacements in one pass and record them as a single change
+ * covering everything from the first to the last edit. Edits are sorted,
+ * must not overlap and must not touch the last newline of the buffer.
+ * Cursor is left at beginning of the first edit.
+ */
+void buffer_bulk_replace(struct bulk_edit *edits, long count)
+{
+	struct bulk_edit *last = &edits[count - 1];
+	long first = edits[0].offset;
+	long del_count = last->offset + last->del - first;
+	long delta = 0;
+	char *deleted;
+	long i;
+
+	view_reset_preferred_x(view);
+	change_merge = CHANGE_MERGE_NONE;
+	before_bulk_edit(edits, count);
+	block_iter_goto_offset(&view->cursor, first);
+	deleted = block_iter_get_bytes(&view->cursor, del_count);
+
+	for (i = 0; i < count; i++) {
+		struct bulk_edit *e = &edits[i];
+
+		journal_edit(buffer, e->offset + delta, e->del, e->buf, e->ins);
+		delta += e->ins - e->del;
+	}
+
+	do_bulk_replace(edits, count);
+	for (i = 0; i < count; i++)
+		free(edits[i].deleted);
+
+	if (del_count || del_count + delta) {
+		if (!del_count) {
+			// only empty matches at one position
+			record_insert(delta);
+		} else if (!(del_count + delta)) {
+			record_delete(deleted, del_count, false);
+			deleted = NULL;
+		} else {
+			record_replace(deleted, del_count, del_count + delta);
+			deleted = NULL;
+		}
+	}
+	free(deleted);
+	limit_undo_memory();
 
 	if (buffer->views.count > 1)
-		fix_cursors(block_iter_get_offset(&view->cursor), del_count, ins_count);
+		fix_cursors(first, del_count, del_count + delta);
 }
@@ -11,6 +11,17 @@ enum change_merge {
 };
 
 struct change;
+struct buffer;
+struct bulk_edit;
+
+struct undo_stats {
+	long changes;
+	// deleted bytes in memory and in the spill file
+	long memory;
+	long spilled;
+	// size of the spill file shared by all buffers
+	long spill_file;
+};
 
 void begin_change(enum change_merge m);
 void end_change(void);
@@ -19,9 +30,14 @@ void end_change_chain(void);
 bool undo(void);
 bool redo(unsigned int change_id);
 void free_changes(struct change *head);
+void reset_changes(struct buffer *b);
+void get_undo_stats(struct undo_stats *s);
+char *read_change_payload(struct buffer *b, const struct change *change);
+void buffer_replay_edit(long offset, long del, const char *ins, long ins_count);
 void buffer_insert_bytes(const char *buf, long len);
 void buffer_delete_bytes(long len);
 void buffer_erase_bytes(long len);
 void buffer_replace_bytes(long del_count, const char *inserted, long ins_count);
+void buffer_bulk_replace(struct bulk_edit *edits, long count);
 
 #endif
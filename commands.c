@@ -31,6 +31,8 @@
 #include "error.h"
 #include "input-special.h"
 #include "git-open.h"
+#include "block.h"
+#include "block-tree.h"
 
 // go to compiler error saving position if file changed or cursor moved
 static void activate_current_message_save(void)
@@ -59,6 +61,18 @@ static void cmd_bind(const char *pf, char **args)
 		remove_binding(args[0]);
 }
 
+static void cmd_block_stats(const char *pf, char **args)
+{
+	const struct block_pool_stats *s = &buffer->pool.stats;
+	long text = block_tree_size(&buffer->blocks);
+
+	info_msg("%ld blocks, text %ld KiB, payloads %ld KiB, slabs %ld (%ld KiB unused), large %ld (%ld KiB), mapped %ld (%ld KiB), allocs %ld, frees %ld",
+		s->blocks, text / 1024, (s->data_bytes + s->large_bytes) / 1024,
+		s->slabs, block_pool_unused(&buffer->pool) / 1024,
+		s->large, s->large_bytes / 1024,
+		s->mapped, s->mapped_bytes / 1024, s->allocs, s->frees);
+}
+
 static void cmd_bof(const char *pf, char **args)
 {
 	move_bof();
@@ -179,6 +193,29 @@ static void cmd_command(const char *pf, char **args)
 		cmdline_set_text(&cmdline, args[0]);
 }
 
+// mapped blocks have no payload and are not counted
+static long average_fill(struct buffer *b)
+{
+	const struct block_pool_stats *s = &b->pool.stats;
+	long payload = s->data_bytes + s->large_bytes;
+
+	if (!payload)
+		return 100;
+	return (block_tree_size(&b->blocks) - s->mapped_bytes) * 100 / payload;
+}
+
+static void cmd_compact(const char *pf, char **args)
+{
+	long blocks = buffer->pool.stats.blocks;
+	long fill = average_fill(buffer);
+
+	buffer->compact_pos = 0;
+	compact_blocks(buffer, LONG_MAX);
+
+	info_msg("Blocks %ld -> %ld, average fill %ld%% -> %ld%%",
+		blocks, buffer->pool.stats.blocks, fill, average_fill(buffer));
+}
+
 static void cmd_compile(const char *pf, char **args)
 {
 	struct compiler *c;
@@ -345,6 +382,7 @@ static void cmd_filter(const char *pf, char **args)
 	} else {
 		struct block *blk;
 
+		finish_loading(buffer);
 		data.in_len = 0;
 		list_for_each_entry(blk, &buffer->blocks, node)
 			data.in_len += blk->size;
@@ -943,6 +981,10 @@ static void cmd_save(const char *pf, char **args)
 
 	buffer->saved_change = buffer->cur_change;
 	buffer->ro = false;
+	if (blocks_fragmented(buffer)) {
+		buffer->compact_pos = 0;
+		compact_blocks(buffer, LONG_MAX);
+	}
 	buffer->newline = newline;
 	if (encoding != buffer->encoding) {
 		free(buffer->encoding);
@@ -1295,6 +1337,15 @@ static void cmd_undo(const char *pf, char **args)
 	}
 }
 
+static void cmd_undo_stats(const char *pf, char **args)
+{
+	struct undo_stats s;
+
+	get_undo_stats(&s);
+	info_msg("%ld changes, deleted text %ld KiB in memory, %ld KiB spilled, spill file %ld KiB",
+		s.changes, s.memory / 1024, s.spilled / 1024, s.spill_file / 1024);
+}
+
 static void cmd_unselect(const char *pf, char **args)
 {
 	unselect();
@@ -1491,6 +1542,7 @@ static void cmd_wswap(const char *pf, char **args)
 const struct command commands[] = {
 	{ "alias",		"",	2,  2, cmd_alias },
 	{ "bind",		"",	1,  2, cmd_bind },
+	{ "block-stats",	"",	0,  0, cmd_block_stats },
 	{ "bof",		"",	0,  0, cmd_bof },
 	{ "bol",		"",	0,  0, cmd_bol },
 	{ "case",		"lu",	0,  0, cmd_case },
@@ -1499,6 +1551,7 @@ const struct command commands[] = {
 	{ "clear",		"",	0,  0, cmd_clear },
 	{ "close",		"fqw",	0,  0, cmd_close },
 	{ "command",		"",	0,  1, cmd_command },
+	{ "compact",		"",	0,  0, cmd_compact },
 	{ "compile",		"-1ps",	2, -1, cmd_compile },
 	{ "copy",		"",	0,  0, cmd_copy },
 	{ "cut",		"",	0,  0, cmd_cut },
@@ -1555,6 +1608,7 @@ const struct command commands[] = {
 	{ "tag",		"r",	0,  1, cmd_tag },
 	{ "toggle",		"glv",	1, -1, cmd_toggle },
 	{ "undo",		"",	0,  0, cmd_undo },
+	{ "undo-stats",		"",	0,  0, cmd_undo_stats },
 	{ "unselect",		"",	0,  0, cmd_unselect },
 	{ "up",			"",	0,  0, cmd_up },
 	{ "view",		"",	1,  1, cmd_view },
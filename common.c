@@ -4,21 +4,6 @@
 const char hex_tab[16] = "0123456789abcdef";
 bool term_utf8;
 
-long count_nl(const char *buf, long size)
-{
-	const char *end = buf + size;
-	long nl = 0;
-
-	while (buf < end) {
-		buf = memchr(buf, '\n', end - buf);
-		if (!buf)
-			break;
-		buf++;
-		nl++;
-	}
-	return nl;
-}
-
 int count_strings(char **strings)
 {
 	int count;
@@ -36,6 +21,19 @@ void free_strings(char **strings)
 	free(strings);
 }
 
+// continue hash from FNV1A_INIT or from previous call
+unsigned long long fnv1a(unsigned long long hash, const void *buf, long size)
+{
+	const unsigned char *p = buf;
+	long i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
 int number_width(long n)
 {
 	int width = 0;
@@ -74,10 +74,12 @@ static inline bool str_has_suffix(const char *str, const char *suffix)
 	return memcmp(str + l1 - l2, suffix, l2) == 0;
 }
 
-long count_nl(const char *buf, long size);
 int count_strings(char **strings);
 void free_strings(char **strings);
+#define FNV1A_INIT 14695981039346656037ULL
+
 int number_width(long n);
+unsigned long long fnv1a(unsigned long long hash, const void *buf, long size);
 bool buf_parse_long(const char *str, int size, int *posp, long *valp);
 bool parse_long(const char **strp, long *valp);
 bool str_to_long(const char *str, long *valp);
@@ -11,6 +11,13 @@
 #include "command.h"
 #include "modes.h"
 #include "error.h"
+#include "block.h"
+#include "load-save.h"
+#include "journal.h"
+#include "hl.h"
+
+// milliseconds without input before doing background work
+#define IDLE_DELAY 100
 
 enum editor_status editor_status;
 enum input_mode input_mode;
@@ -29,6 +36,10 @@ static void sanity_check(void)
 	if (!DEBUG)
 		return;
 
+	BUG_ON(v->cursor.offset > v->cursor.blk->size);
+	if (DEBUG <= 2)
+		return;
+
 	list_for_each_entry(blk, &v->buffer->blocks, node) {
 		if (blk == v->cursor.blk) {
 			BUG_ON(v->cursor.offset > v->cursor.blk->size);
@@ -393,13 +404,103 @@ void set_signal_handler(int signum, void (*handler)(int))
 	sigaction(signum, &act, NULL);
 }
 
+// does a small piece of background work, returns false if there is nothing to do
+static bool idle_work(void)
+{
+	long i;
+
+	for (i = 0; i < buffers.count; i++) {
+		if (journal_flush(buffers.ptrs[i]))
+			return true;
+	}
+	for (i = 0; i < buffers.count; i++) {
+		struct buffer *b = buffers.ptrs[i];
+		struct screen_state s;
+
+		if (!b->map)
+			continue;
+		save_state(&s, window->view);
+		if (check_mapping(b)) {
+			if (input_mode != INPUT_GIT_OPEN)
+				update_screen(&s);
+			return true;
+		}
+	}
+	for (i = 0; i < buffers.count; i++) {
+		struct buffer *b = buffers.ptrs[i];
+
+		if (buffer_loading(b)) {
+			struct screen_state s;
+
+			save_state(&s, window->view);
+			load_more(b, LAZY_LOAD_SLICE);
+			if (input_mode != INPUT_GIT_OPEN)
+				update_screen(&s);
+			return true;
+		}
+		if (b->hl_goal) {
+			if (b->hl_goal > b->nl)
+				b->hl_goal = b->nl;
+			if (hl_fill_start_states(b, b->hl_goal, options.highlight_slice)) {
+				struct screen_state s;
+
+				// repaint what was drawn with guessed states
+				b->hl_goal = 0;
+				save_state(&s, window->view);
+				mark_all_lines_changed(b);
+				if (b != window->view->buffer)
+					mark_everything_changed();
+				if (input_mode != INPUT_GIT_OPEN)
+					update_screen(&s);
+			}
+			return true;
+		}
+		if (b->compact_pos || blocks_fragmented(b)) {
+			compact_blocks(b, 4096);
+			return true;
+		}
+	}
+	return false;
+}
+
+// milliseconds until some journal must be synced or -1 if never
+static int journal_delay(void)
+{
+	long delay = -1;
+	long i;
+
+	for (i = 0; i < buffers.count; i++) {
+		long d = journal_sync_delay(buffers.ptrs[i]);
+
+		if (d >= 0 && (delay < 0 || d < delay))
+			delay = d;
+	}
+	return delay;
+}
+
 void main_loop(void)
 {
+	bool idle = true;
+	int delay = IDLE_DELAY;
+
 	while (editor_status == EDITOR_RUNNING) {
 		int key;
 
 		if (resized)
 			resize();
+		if (idle && !term_wait_input(delay)) {
+			// continue immediately until there's input
+			idle = idle_work();
+			delay = 0;
+			if (!idle) {
+				// wait for input but not past the next journal sync
+				delay = journal_delay();
+				idle = delay >= 0;
+			}
+			continue;
+		}
+		idle = true;
+		delay = IDLE_DELAY;
 		if (!term_read_key(&key))
 			continue;
 
@@ -409,8 +510,20 @@ void main_loop(void)
 			modes[input_mode]->update();
 		} else {
 			struct screen_state s;
-			save_state(&s, window->view);
+			struct view *v = window->view;
+			long i;
+
+			// mapped files must be checked before their blocks are read
+			for (i = 0; i < buffers.count; i++)
+				check_mapping(buffers.ptrs[i]);
+			// lines below the screen are needed for scrolling
+			load_lines(v->buffer, v->vy + 3 * window->edit_h);
+			save_state(&s, v);
 			modes[input_mode]->keypress(key);
+			// line numbers of the cursor's lines must be known
+			v = window->view;
+			if (v->cursor.blk->uncounted)
+				count_lines(v->buffer, block_iter_get_offset(&v->cursor), 0);
 			sanity_check();
 			if (input_mode == INPUT_GIT_OPEN) {
 				modes[input_mode]->update();
@@ -1,6 +1,7 @@
 #include "format-status.h"
 #include "window.h"
 #include "view.h"
+#include "block-tree.h"
 #include "uchar.h"
 
 static void add_ch(struct formatter *f, char ch)
@@ -39,13 +40,26 @@ static void add_status_format(struct formatter *f, const char *format, ...)
 	add_status_str(f, buf);
 }
 
+// lines before the cursor have not all been counted, see load_line()
+static bool cursor_line_estimated(struct view *v)
+{
+	struct ptr_array *a = &v->buffer->uncounted;
+
+	return a->count && block_start_line(a->ptrs[0]) < v->cy;
+}
+
 static void add_status_pos(struct formatter *f)
 {
-	long lines = f->win->view->buffer->nl;
+	struct view *v = f->win->view;
+	long lines = v->buffer->nl;
 	int h = f->win->edit_h;
-	int pos = f->win->view->vy;
+	int pos = v->vy;
 
-	if (lines <= h) {
+	if (buffer_loading(v->buffer) && pos) {
+		// number of lines is not known yet
+		long offset = view_get_cursor_offset(v);
+		add_status_format(f, "%2d%%", (int)(offset * 100 / v->buffer->map_size));
+	} else if (lines <= h) {
 		if (pos)
 			add_status_str(f, "Bot");
 		else
@@ -98,10 +112,14 @@ void sf_format(struct formatter *f, char *buf, long size, const char *format)
 					add_status_str(f, "RO");
 				break;
 			case 'y':
+				if (cursor_line_estimated(v))
+					add_status_str(f, "~");
 				add_status_format(f, "%d", v->cy + 1);
 				break;
 			case 'Y':
 				add_status_format(f, "%ld", v->buffer->nl);
+				if (buffer_loading(v->buffer))
+					add_status_str(f, "+");
 				break;
 			case 'x':
 				add_status_format(f, "%d", v->cx_display + 1);
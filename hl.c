@@ -1,8 +1,11 @@
 #include "hl.h"
 #include "buffer.h"
 #include "syntax.h"
+#include "block-tree.h"
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
 
 static bool state_is_valid(const struct state *st)
 {
@@ -38,28 +41,37 @@ static bool is_buffered(const struct condition *cond, const char *str, int len)
 	return !memcmp(cond->u.cond_bufis.str, str, len);
 }
 
-static bool in_hash(struct string_list *list, const char *str, int len)
+static bool in_hash(const struct string_list *list, const char *str, int len)
 {
-	unsigned int hash = buf_hash(str, len);
-	struct hash_str *h = list->hash[hash % ARRAY_COUNT(list->hash)];
+	unsigned int hash, i;
 
 	if (list->icase) {
-		while (h) {
-			if (len == h->len && !strncasecmp(str, h->str, len))
-				return true;
-			h = h->next;
-		}
+		hash = buf_hash_icase(str, len);
 	} else {
-		while (h) {
-			if (len == h->len && !memcmp(str, h->str, len))
+		hash = buf_hash(str, len);
+	}
+	for (i = hash & list->mask; ; i = (i + 1) & list->mask) {
+		const struct hash_str *h = &list->slots[i];
+
+		if (h->len < 0)
+			return false;
+		if (h->hash != hash || h->len != len)
+			continue;
+		if (list->icase) {
+			if (!strncasecmp(hash_str_ptr(h), str, len))
+				return true;
+		} else {
+			if (!memcmp(hash_str_ptr(h), str, len))
 				return true;
-			h = h->next;
 		}
 	}
-	return false;
 }
 
-static struct state *handle_heredoc(struct syntax *syn, struct state *state, const char *delim, int len)
+// merge_syntax() and interning modify the syntax, see speculate()
+static pthread_mutex_t heredoc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// heredoc nested in heredoc can't share the delimiter
+static struct state *find_heredoc(struct syntax *syn, struct state *state, const char *delim, int len)
 {
 	struct heredoc_state *s;
 	struct syntax_merge m;
@@ -75,6 +87,7 @@ static struct state *handle_heredoc(struct syntax *syn, struct state *state, con
 	m.return_state = state->a.destination;
 	m.delim = delim;
 	m.delim_len = len;
+	m.heredoc = true;
 
 	s = xnew0(struct heredoc_state, 1);
 	s->state = merge_syntax(syn, &m);
@@ -84,18 +97,259 @@ static struct state *handle_heredoc(struct syntax *syn, struct state *state, con
 	return s->state;
 }
 
+static unsigned int ptr_hash(const void *ptr)
+{
+	return buf_hash((const char *)&ptr, sizeof(ptr));
+}
+
+static unsigned int delim_hash(const void *entry)
+{
+	const struct heredoc_delim *d = entry;
+	return d->hash;
+}
+
+static unsigned int line_hash(const void *entry)
+{
+	const struct heredoc_line *l = entry;
+	return ptr_hash(l->state);
+}
+
+static void intern_insert(struct intern_table *t, void *entry, unsigned int hash)
+{
+	unsigned int i = hash & t->mask;
+
+	while (t->slots[i])
+		i = (i + 1) & t->mask;
+	t->slots[i] = entry;
+}
+
+// entries are never removed, table grows at 3/4 full
+static void intern_add(struct intern_table *t, void *entry, unsigned int hash, unsigned int (*entry_hash)(const void *))
+{
+	if ((t->count + 1) * 4 > (t->mask + 1) * 3) {
+		struct intern_table new;
+		unsigned int i;
+
+		new.mask = t->slots ? t->mask * 2 + 1 : 7;
+		new.slots = xnew0(void *, new.mask + 1);
+		new.count = t->count;
+		for (i = 0; t->slots && i <= t->mask; i++) {
+			if (t->slots[i])
+				intern_insert(&new, t->slots[i], entry_hash(t->slots[i]));
+		}
+		free(t->slots);
+		*t = new;
+	}
+	intern_insert(t, entry, hash);
+	t->count++;
+}
+
+static struct heredoc_delim *find_delim(struct syntax *syn, const char *str, int len)
+{
+	struct intern_table *t = &syn->heredoc_delims;
+	unsigned int hash = buf_hash(str, len);
+	struct heredoc_delim *d;
+	unsigned int i;
+
+	for (i = hash & t->mask; t->slots && (d = t->slots[i]); i = (i + 1) & t->mask) {
+		if (d->hash == hash && d->len == len && !memcmp(d->str, str, len))
+			return d;
+	}
+
+	d = xnew0(struct heredoc_delim, 1);
+	d->str = xmemdup(str, len);
+	d->len = len;
+	d->hash = hash;
+	intern_add(t, d, hash, delim_hash);
+	return d;
+}
+
+static struct state *shared_heredoc(struct syntax *syn, struct state *state)
+{
+	struct syntax_merge m;
+
+	if (state->heredoc.shared)
+		return state->heredoc.shared;
+
+	m.subsyn = state->heredoc.subsyntax;
+	m.return_state = state->a.destination;
+	m.delim = NULL;
+	m.delim_len = 0;
+	m.heredoc = true;
+	state->heredoc.shared = merge_syntax(syn, &m);
+	return state->heredoc.shared;
+}
+
+/*
+ * Heredoc subsyntax is merged only once. The delimiter is kept in *delim
+ * while highlighting and becomes part of line start state, see
+ * heredoc_line_state().
+ */
+static struct state *handle_heredoc(struct syntax *syn, struct state *state, struct heredoc_delim **delim, const char *str, int len)
+{
+	pthread_mutex_lock(&heredoc_mutex);
+	if (state->in_heredoc) {
+		state = find_heredoc(syn, state, str, len);
+	} else {
+		*delim = find_delim(syn, str, len);
+		state = shared_heredoc(syn, state);
+	}
+	pthread_mutex_unlock(&heredoc_mutex);
+	return state;
+}
+
+/*
+ * Line start state inside heredoc is a pointer to interned struct
+ * heredoc_line tagged with bit 1 so that equal states are equal pointers.
+ */
+static bool is_heredoc_line(const struct state *st)
+{
+	return ((uintptr_t)st & 2) != 0;
+}
+
+static const struct heredoc_line *to_heredoc_line(const struct state *st)
+{
+	return (const struct heredoc_line *)((uintptr_t)st & ~(uintptr_t)2);
+}
+
+static struct state *heredoc_line_state(struct state *state, struct heredoc_delim *delim)
+{
+	struct intern_table *t = &delim->lines;
+	unsigned int hash = ptr_hash(state);
+	struct heredoc_line *l;
+	unsigned int i;
+
+	pthread_mutex_lock(&heredoc_mutex);
+	for (i = hash & t->mask; t->slots && (l = t->slots[i]); i = (i + 1) & t->mask) {
+		if (l->state == state)
+			goto out;
+	}
+	l = xnew(struct heredoc_line, 1);
+	l->state = state;
+	l->delim = delim;
+	intern_add(t, l, hash, line_hash);
+out:
+	pthread_mutex_unlock(&heredoc_mutex);
+	return (struct state *)((uintptr_t)l | 2);
+}
+
+// last span of a line is kept here while highlighting, see emit()
+struct open_span {
+	struct hl_color *color;
+	int start;
+};
+
+// adds span, merging it with the previous one if possible
+static void add_span(struct hl_spans *buf, int start, int end, struct hl_color *color)
+{
+	struct hl_span *span;
+
+	if (start == end)
+		return;
+	if (buf->count) {
+		span = &buf->spans[buf->count - 1];
+		if (span->color == color) {
+			span->len += end - start;
+			return;
+		}
+	}
+	if (buf->count == buf->alloc) {
+		buf->alloc = ROUND_UP(buf->count + 1, 64);
+		xrenew(buf->spans, buf->alloc);
+	}
+	span = &buf->spans[buf->count++];
+	span->start = start;
+	span->len = end - start;
+	span->color = color;
+}
+
+// colors bytes from pos onwards
+static inline void emit(struct hl_spans *buf, struct open_span *os, int pos, struct hl_color *color)
+{
+	if (color != os->color) {
+		add_span(buf, os->start, pos, os->color);
+		os->color = color;
+		os->start = pos;
+	}
+}
+
+// recolors bytes from start to end, end is the current position
+static void recolor(struct hl_spans *buf, struct open_span *os, int start, int end, struct hl_color *color)
+{
+	if (start == end)
+		return;
+	add_span(buf, os->start, end, os->color);
+	while (buf->count && buf->spans[buf->count - 1].start >= start)
+		buf->count--;
+	if (buf->count) {
+		struct hl_span *span = &buf->spans[buf->count - 1];
+
+		if (span->start + span->len > start)
+			span->len = start - span->start;
+	}
+	os->color = color;
+	os->start = start;
+}
+
+#define ONES ((unsigned long)-1 / 0xff)
+
+// non-zero if any byte of x is zero
+static inline unsigned long has_zero_byte(unsigned long x)
+{
+	return (x - ONES) & ~x & ONES * 0x80;
+}
+
+/*
+ * Returns index of first byte starting from i which can match a condition
+ * of s. Bytes before it are eaten by s if it loops to itself. Like
+ * memchr() but searches a word at a time for up to three bytes.
+ */
+static int skip_run(const struct state *s, const char *line, int i, int len)
+{
+	const unsigned char *stop = s->stop_bytes;
+
+	switch (s->nr_stop_bytes) {
+	case 0:
+		return len;
+	case 1: {
+		const char *p = memchr(line + i, stop[0], len - i);
+		return p ? p - line : len;
+		}
+	case 2:
+	case 3: {
+		unsigned long a = ONES * stop[0];
+		unsigned long b = ONES * stop[1];
+		unsigned long c = ONES * stop[s->nr_stop_bytes - 1];
+
+		while (len - i >= sizeof(unsigned long)) {
+			unsigned long x;
+
+			memcpy(&x, line + i, sizeof(x));
+			if (has_zero_byte(x ^ a) | has_zero_byte(x ^ b) | has_zero_byte(x ^ c))
+				break;
+			i += sizeof(x);
+		}
+		} break;
+	}
+	while (i < len && s->first_cond[(unsigned char)line[i]] == s->conds.count)
+		i++;
+	return i;
+}
+
 // line should be terminated with \n unless it's the last line
-static struct hl_color **highlight_line(struct syntax *syn, struct state *state, const char *line, int len, struct state **ret)
+static void highlight(struct hl_spans *buf, struct syntax *syn, struct state *state, const char *line, int len, struct state **ret)
 {
-	static struct hl_color **colors;
-	static int alloc;
+	struct open_span os = { NULL, 0 };
+	struct heredoc_delim *delim = NULL;
 	int i = 0, sidx = -1;
 
-	if (len > alloc) {
-		alloc = ROUND_UP(len, 128);
-		xrenew(colors, alloc);
+	if (is_heredoc_line(state)) {
+		const struct heredoc_line *l = to_heredoc_line(state);
+		state = l->state;
+		delim = l->delim;
 	}
 
+	buf->count = 0;
 	while (1) {
 		const struct condition *cond;
 		const struct action *a;
@@ -105,7 +359,7 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 		if (i == len)
 			break;
 		ch = line[i];
-		for (ci = 0; ci < state->conds.count; ci++) {
+		for (ci = state->first_cond[ch]; ci < state->conds.count; ci++) {
 			cond = state->conds.ptrs[ci];
 			a = &cond->a;
 			switch (cond->type) {
@@ -114,14 +368,12 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 					break;
 				if (sidx < 0)
 					sidx = i;
-				colors[i++] = a->emit_color;
+				emit(buf, &os, i++, a->emit_color);
 				state = a->destination;
 				goto top;
 			case COND_BUFIS:
 				if (sidx >= 0 && is_buffered(cond, line + sidx, i - sidx)) {
-					int idx;
-					for (idx = sidx; idx < i; idx++)
-						colors[idx] = a->emit_color;
+					recolor(buf, &os, sidx, i, a->emit_color);
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -130,15 +382,13 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 			case COND_CHAR:
 				if (!bitmap_get(cond->u.cond_char.bitmap, ch))
 					break;
-				colors[i++] = a->emit_color;
+				emit(buf, &os, i++, a->emit_color);
 				sidx = -1;
 				state = a->destination;
 				goto top;
 			case COND_INLIST:
 				if (sidx >= 0 && in_hash(cond->u.cond_inlist.list, line + sidx, i - sidx)) {
-					int idx;
-					for (idx = sidx; idx < i; idx++)
-						colors[idx] = a->emit_color;
+					recolor(buf, &os, sidx, i, a->emit_color);
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -148,13 +398,11 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				int idx = i - cond->u.cond_recolor.len;
 				if (idx < 0)
 					idx = 0;
-				while (idx < i)
-					colors[idx++] = a->emit_color;
+				recolor(buf, &os, idx, i, a->emit_color);
 				} break;
 			case COND_RECOLOR_BUFFER:
 				if (sidx >= 0) {
-					while (sidx < i)
-						colors[sidx++] = a->emit_color;
+					recolor(buf, &os, sidx, i, a->emit_color);
 					sidx = -1;
 				}
 				break;
@@ -162,8 +410,8 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				int slen = cond->u.cond_str.len;
 				int end = i + slen;
 				if (len >= end && !memcmp(cond->u.cond_str.str, line + i, slen)) {
-					while (i < end)
-						colors[i++] = a->emit_color;
+					emit(buf, &os, i, a->emit_color);
+					i = end;
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -173,8 +421,8 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				int slen = cond->u.cond_str.len;
 				int end = i + slen;
 				if (len >= end && !strncasecmp(cond->u.cond_str.str, line + i, slen)) {
-					while (i < end)
-						colors[i++] = a->emit_color;
+					emit(buf, &os, i, a->emit_color);
+					i = end;
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -184,19 +432,26 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 				// optimized COND_STR (length 2, case sensitive)
 				if (ch == cond->u.cond_str.str[0] && len - i > 1 &&
 						line[i + 1] == cond->u.cond_str.str[1]) {
-					colors[i++] = a->emit_color;
-					colors[i++] = a->emit_color;
+					emit(buf, &os, i, a->emit_color);
+					i += 2;
 					sidx = -1;
 					state = a->destination;
 					goto top;
 				}
 				break;
 			case COND_HEREDOCEND: {
+				const char *str = cond->u.cond_heredocend.str;
 				int slen = cond->u.cond_heredocend.len;
-				int end = i + slen;
-				if (len >= end && !memcmp(cond->u.cond_heredocend.str, line + i, slen)) {
-					while (i < end)
-						colors[i++] = a->emit_color;
+				int end;
+				if (state->in_heredoc && str == NULL) {
+					// delimiter of shared heredoc
+					str = delim->str;
+					slen = delim->len;
+				}
+				end = i + slen;
+				if (len >= end && !memcmp(str, line + i, slen)) {
+					emit(buf, &os, i, a->emit_color);
+					i = end;
 					sidx = -1;
 					state = a->destination;
 					goto top;
@@ -207,7 +462,9 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 
 		switch (state->type) {
 		case STATE_EAT:
-			colors[i++] = state->a.emit_color;
+			emit(buf, &os, i++, state->a.emit_color);
+			if (state->a.destination == state)
+				i = skip_run(state, line, i, len);
 			// fallthrough
 		case STATE_NOEAT:
 			sidx = -1;
@@ -219,14 +476,325 @@ static struct hl_color **highlight_line(struct syntax *syn, struct state *state,
 		case STATE_HEREDOCBEGIN:
 			if (sidx < 0)
 				sidx = i;
-			state = handle_heredoc(syn, state, line + sidx, i - sidx);
+			state = handle_heredoc(syn, state, &delim, line + sidx, i - sidx);
 			break;
 		}
 	}
 
-	if (ret)
+	add_span(buf, os.start, len, os.color);
+	if (ret) {
+		// delimiter is stale if heredoc ended on this line
+		if (delim && state->in_heredoc)
+			state = heredoc_line_state(state, delim);
 		*ret = state;
-	return colors;
+	}
+}
+
+static struct hl_spans line_buf;
+
+static struct hl_spans *highlight_line(struct syntax *syn, struct state *state, const char *line, int len, struct state **ret)
+{
+	highlight(&line_buf, syn, state, line, len, ret);
+	return &line_buf;
+}
+
+/*
+ * Highlighting many lines for start states can take seconds. When there is
+ * a time limit it is checked every HL_CHECK_LINES lines and before every
+ * block.
+ */
+#define HL_CHECK_LINES 64
+
+/*
+ * At most this many line start states are kept around the view. Start
+ * states of other lines are computed from the checkpoint of their block.
+ */
+#define HL_CACHE_MAX 4096
+
+static struct timeval deadline;
+static bool have_deadline;
+static bool timed_out;
+static unsigned int hl_lines;
+
+// 0 means no time limit
+static void set_deadline(long usec)
+{
+	have_deadline = usec > 0;
+	timed_out = false;
+	if (have_deadline) {
+		gettimeofday(&deadline, NULL);
+		deadline.tv_usec += usec;
+		deadline.tv_sec += deadline.tv_usec / 1000000;
+		deadline.tv_usec %= 1000000;
+	}
+}
+
+static bool deadline_passed(void)
+{
+	struct timeval now;
+
+	if (timed_out)
+		return true;
+	if (!have_deadline)
+		return false;
+	gettimeofday(&now, NULL);
+	timed_out = !timercmp(&now, &deadline, <);
+	return timed_out;
+}
+
+static bool out_of_time(void)
+{
+	if (timed_out)
+		return true;
+	if (!have_deadline || ++hl_lines % HL_CHECK_LINES)
+		return false;
+	return deadline_passed();
+}
+
+/*
+ * Every block has a checkpoint, start state of its first line. It is
+ * computed by highlighting the previous block from its checkpoint.
+ *
+ * Checkpoints are invalidated like line start states. NULL means unknown
+ * (new block).
+ */
+static bool checkpoint_is_valid(const struct block *blk)
+{
+	return blk->hl_start && state_is_valid(blk->hl_start);
+}
+
+static void invalidate_checkpoint(struct block *blk)
+{
+	blk->hl_start = (struct state *)((uintptr_t)blk->hl_start | 1);
+}
+
+// returns block containing start of line, *start is set to first line of the block
+static struct block *find_line_block(struct buffer *b, long line, long *start)
+{
+	long nl = line;
+	struct block *blk = block_find_line(&b->blocks, &nl);
+
+	while (nl == blk->nl && blk->node.next != &b->blocks) {
+		blk = BLOCK(blk->node.next);
+		nl = 0;
+	}
+	*start = line - nl;
+	return blk;
+}
+
+// returns start state of the line after blk if st is start state of blk
+static struct state *highlight_block(struct hl_spans *buf, struct syntax *syn, struct block *blk, struct state *st)
+{
+	const unsigned char *line = blk->data;
+	const unsigned char *end = line + blk->size;
+
+	while (line < end) {
+		const unsigned char *nl = memchr(line, '\n', end - line);
+		long len = nl ? nl + 1 - line : end - line;
+
+		highlight(buf, syn, st, line, len, &st);
+		line += len;
+	}
+	return st;
+}
+
+/*
+ * Blocks that have never been highlighted (new file, syntax changed) are
+ * highlighted in parallel. Each block is highlighted from the start state
+ * of the syntax and the result is used only if that turns out to be the
+ * real start state of the block. Otherwise the block is highlighted again.
+ */
+#define SPEC_MAX_THREADS 32
+#define SPEC_BLOCKS_PER_THREAD 32
+
+struct spec_block {
+	struct block *blk;
+	struct state *guess;
+	struct state *end;
+};
+
+struct spec_job {
+	struct syntax *syn;
+	int first;
+	int step;
+};
+
+static struct spec_block spec[SPEC_MAX_THREADS * SPEC_BLOCKS_PER_THREAD];
+static int spec_count;
+static int spec_pos;
+
+static int nr_threads(void)
+{
+	static int count;
+
+	if (!count) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		count = n < 1 ? 1 : n > SPEC_MAX_THREADS ? SPEC_MAX_THREADS : n;
+	}
+	return count;
+}
+
+static bool never_highlighted(const struct block *blk)
+{
+	return ((uintptr_t)blk->hl_start & ~(uintptr_t)1) == 0;
+}
+
+static void *speculate_thread(void *data)
+{
+	struct spec_job *job = data;
+	struct hl_spans buf = { NULL, 0, 0 };
+	int i;
+
+	for (i = job->first; i < spec_count; i += job->step) {
+		struct spec_block *sb = &spec[i];
+		sb->end = highlight_block(&buf, job->syn, sb->blk, sb->guess);
+	}
+	free(buf.spans);
+	return NULL;
+}
+
+// blk has valid checkpoint
+static void speculate(struct buffer *b, struct block *blk, struct block *last)
+{
+	struct spec_job jobs[SPEC_MAX_THREADS];
+	pthread_t threads[SPEC_MAX_THREADS];
+	bool started[SPEC_MAX_THREADS];
+	struct state *guess = blk->hl_start;
+	int count = nr_threads();
+	int i;
+
+	spec_count = 0;
+	spec_pos = 0;
+	if (count == 1)
+		return;
+
+	while (spec_count < count * SPEC_BLOCKS_PER_THREAD && blk != last) {
+		struct block *next = BLOCK(blk->node.next);
+
+		if (!never_highlighted(next) || blk->uncounted)
+			break;
+		spec[spec_count].blk = blk;
+		spec[spec_count].guess = guess;
+		spec_count++;
+		guess = b->syn->states.ptrs[0];
+		blk = next;
+	}
+	if (spec_count < count * 2) {
+		// not worth it
+		spec_count = 0;
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		jobs[i].syn = b->syn;
+		jobs[i].first = i;
+		jobs[i].step = count;
+		started[i] = i && !pthread_create(&threads[i], NULL, speculate_thread, &jobs[i]);
+	}
+	for (i = 0; i < count; i++) {
+		if (!started[i])
+			speculate_thread(&jobs[i]);
+	}
+	for (i = 1; i < count; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+}
+
+// returns NULL if start state of blk was guessed wrong
+static struct state *speculated(struct block *blk)
+{
+	while (spec_pos < spec_count) {
+		struct spec_block *sb = &spec[spec_pos++];
+
+		if (sb->blk == blk)
+			return sb->guess == blk->hl_start ? sb->end : NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Makes checkpoints of blocks up to and including last valid. start is
+ * first line of last.
+ */
+static bool fill_checkpoints(struct buffer *b, struct block *last, long start)
+{
+	struct block *blk;
+	long line;
+
+	// start state of first line is constant
+	BLOCK(b->blocks.next)->hl_start = b->syn->states.ptrs[0];
+
+	if (start < b->hl_valid) {
+		if (checkpoint_is_valid(last))
+			return true;
+		blk = last;
+		line = start;
+	} else {
+		blk = find_line_block(b, b->hl_valid - 1, &line);
+	}
+
+	// splitting a block creates blocks without checkpoint before the
+	// changed line
+	while (!checkpoint_is_valid(blk)) {
+		blk = BLOCK(blk->node.prev);
+		line -= blk->nl;
+	}
+
+	while (blk != last) {
+		struct block *next = BLOCK(blk->node.next);
+
+		if (!checkpoint_is_valid(next)) {
+			struct state *st;
+
+			// guessed until load_more() has counted its lines
+			if (deadline_passed() || blk->uncounted)
+				break;
+			if (spec_pos == spec_count && never_highlighted(next))
+				speculate(b, blk, last);
+			st = speculated(blk);
+			if (!st)
+				st = highlight_block(&line_buf, b->syn, blk, blk->hl_start);
+			if (((uintptr_t)next->hl_start & ~(uintptr_t)1) != (uintptr_t)st) {
+				// changed, next checkpoint depends on this one
+				if (next->node.next != &b->blocks)
+					invalidate_checkpoint(BLOCK(next->node.next));
+			}
+			next->hl_start = st;
+		}
+		line += blk->nl;
+		blk = next;
+	}
+	spec_count = 0;
+	spec_pos = 0;
+	if (line >= b->hl_valid)
+		b->hl_valid = line + 1;
+	return blk == last;
+}
+
+/*
+ * Changed lines are first..first+lines. Block starting at line first may
+ * be a different block than before the change (deleted text ended at its
+ * beginning) so its checkpoint is invalidated too.
+ */
+static void invalidate_checkpoints(struct buffer *b, int first, int lines)
+{
+	struct block *blk;
+	long start;
+
+	if (b->hl_valid > first)
+		b->hl_valid = first ? first : 1;
+
+	blk = find_line_block(b, first, &start);
+	while (1) {
+		if (start >= first)
+			invalidate_checkpoint(blk);
+		if (start > first + lines || blk->node.next == &b->blocks)
+			break;
+		start += blk->nl;
+		blk = BLOCK(blk->node.next);
+	}
 }
 
 static void resize_line_states(struct ptr_array *s, unsigned int count)
@@ -242,8 +810,14 @@ static void move_line_states(struct ptr_array *s, int to, int from, int count)
 	memmove(s->ptrs + to, s->ptrs + from, count * sizeof(*s->ptrs));
 }
 
-static void block_iter_move_down(struct block_iter *bi, int count)
+// line is current line of bi
+static void block_iter_move_down(struct block_iter *bi, int line, int count)
 {
+	if (count > 64) {
+		// start states are filled in slices far from beginning of file
+		block_iter_goto_line(bi, line + count);
+		return;
+	}
 	while (count--)
 		block_iter_eat_line(bi);
 }
@@ -257,6 +831,12 @@ static int fill_hole(struct buffer *b, struct block_iter *bi, int sidx, int eidx
 		struct lineref lr;
 		struct state *st;
 
+		if (out_of_time()) {
+			// lines after idx have not been highlighted from its state
+			if (idx + 1 < b->line_start_states.count)
+				mark_state_invalid(ptrs, idx + 1);
+			break;
+		}
 		fill_line_nl_ref(bi, &lr);
 		block_iter_eat_line(bi);
 		highlight_line(b->syn, ptrs[idx++], lr.line, lr.size, &st);
@@ -279,7 +859,39 @@ static int fill_hole(struct buffer *b, struct block_iter *bi, int sidx, int eidx
 	return idx - sidx;
 }
 
-void hl_fill_start_states(struct buffer *b, int line_nr)
+/*
+ * Starts line start states from checkpoint of the block containing line_nr
+ * if that is closer than the cached states.
+ */
+static bool move_line_states_window(struct buffer *b, int line_nr)
+{
+	struct ptr_array *s = &b->line_start_states;
+	struct block *blk;
+	long start;
+
+	if (s->count && line_nr >= b->hl_first && line_nr < b->hl_first + s->count)
+		return true;
+
+	blk = find_line_block(b, line_nr, &start);
+	if (s->count && line_nr >= b->hl_first && line_nr - b->hl_first < HL_CACHE_MAX &&
+			start < b->hl_first + s->count)
+		return true;
+
+	if (!fill_checkpoints(b, blk, start))
+		return false;
+	b->hl_first = start;
+	resize_line_states(s, 1);
+	s->ptrs[0] = blk->hl_start;
+	s->count = 1;
+	return true;
+}
+
+/*
+ * Computes start states of lines up to line_nr. If usec is not 0 gives
+ * up after that many microseconds and returns false. Work that has been
+ * done so far is kept and the next call continues from there.
+ */
+bool hl_fill_start_states(struct buffer *b, int line_nr, long usec)
 {
 	BLOCK_ITER(bi, &b->blocks);
 	struct ptr_array *s = &b->line_start_states;
@@ -289,7 +901,15 @@ void hl_fill_start_states(struct buffer *b, int line_nr)
 	int last;
 
 	if (b->syn == NULL)
-		return;
+		return true;
+
+	set_deadline(usec);
+	if (!move_line_states_window(b, line_nr))
+		return false;
+
+	// indexes are relative to b->hl_first from now on
+	block_iter_goto_line(&bi, b->hl_first);
+	line_nr -= b->hl_first;
 
 	// NOTE: "+ 2" so that you don't have to worry about overflow in fill_hole()
 	resize_line_states(s, line_nr + 2);
@@ -309,38 +929,44 @@ void hl_fill_start_states(struct buffer *b, int line_nr)
 
 		// go to line before first hole
 		idx--;
-		block_iter_move_down(&bi, idx - current_line);
+		block_iter_move_down(&bi, b->hl_first + current_line, idx - current_line);
 		current_line = idx;
 
 		// NOTE: might not fill entire hole which is ok
 		count = fill_hole(b, &bi, idx, last);
 		idx += count;
 		current_line += count;
+		if (timed_out)
+			return false;
 	}
 
 	// add new
-	block_iter_move_down(&bi, s->count - 1 - current_line);
+	block_iter_move_down(&bi, b->hl_first + current_line, s->count - 1 - current_line);
 	while (s->count - 1 < line_nr) {
 		struct lineref lr;
 
+		if (out_of_time())
+			return false;
 		fill_line_nl_ref(&bi, &lr);
 		highlight_line(b->syn, states[s->count - 1], lr.line, lr.size, &states[s->count]);
 		s->count++;
 		block_iter_eat_line(&bi);
 	}
+	return true;
 }
 
-struct hl_color **hl_line(struct buffer *b, const char *line, int len, int line_nr, int *next_changed)
+struct hl_spans *hl_line(struct buffer *b, const char *line, int len, int line_nr, int *next_changed)
 {
 	struct ptr_array *s = &b->line_start_states;
-	struct hl_color **colors;
+	struct hl_spans *colors;
 	struct state *next;
 
 	*next_changed = 0;
 	if (b->syn == NULL)
 		return NULL;
 
-	BUG_ON(line_nr >= s->count);
+	line_nr -= b->hl_first;
+	BUG_ON(line_nr < 0 || line_nr >= s->count);
 	colors = highlight_line(b->syn, s->ptrs[line_nr++], line, len, &next);
 
 	if (line_nr == s->count) {
@@ -363,11 +989,62 @@ struct hl_color **hl_line(struct buffer *b, const char *line, int len, int line_
 	return colors;
 }
 
+/*
+ * Highlights line whose start state is not known yet. If *state is NULL
+ * start state of the syntax is used. *state is set to the state at end
+ * of the line.
+ */
+struct hl_spans *hl_line_guess(struct buffer *b, const char *line, int len, struct state **state)
+{
+	if (b->syn == NULL)
+		return NULL;
+	if (*state == NULL)
+		*state = b->syn->states.ptrs[0];
+	return highlight_line(b->syn, *state, line, len, state);
+}
+
+// called after syntax of the buffer has changed
+void hl_reset(struct buffer *b)
+{
+	struct ptr_array *s = &b->line_start_states;
+	struct block *blk;
+
+	list_for_each_entry(blk, &b->blocks, node)
+		blk->hl_start = NULL;
+	b->hl_valid = 1;
+	b->hl_first = 0;
+	s->count = 0;
+	if (b->syn) {
+		// start state of first line is constant
+		resize_line_states(s, 1);
+		s->ptrs[0] = b->syn->states.ptrs[0];
+		s->count = 1;
+	}
+}
+
+// called before next is appended to blk, see compact_blocks()
+void hl_merge_blocks(struct buffer *b, struct block *next)
+{
+	// checkpoint after next can't be computed from next anymore
+	if (!checkpoint_is_valid(next) && next->node.next != &b->blocks)
+		invalidate_checkpoint(BLOCK(next->node.next));
+}
+
 // called after text have been inserted to rehighlight changed lines
 void hl_insert(struct buffer *b, int first, int lines)
 {
 	struct ptr_array *s = &b->line_start_states;
-	int i, last = first + lines;
+	int i, last;
+
+	invalidate_checkpoints(b, first, lines);
+
+	first -= b->hl_first;
+	if (first < 0) {
+		// start states of all cached lines may have changed
+		s->count = 0;
+		return;
+	}
+	last = first + lines;
 
 	if (first >= s->count) {
 		// nothing to rehighlight
@@ -399,7 +1076,16 @@ void hl_insert(struct buffer *b, int first, int lines)
 void hl_delete(struct buffer *b, int first, int deleted_nl)
 {
 	struct ptr_array *s = &b->line_start_states;
-	int last = first + deleted_nl;
+	int last;
+
+	invalidate_checkpoints(b, first, 0);
+
+	first -= b->hl_first;
+	if (first < 0) {
+		s->count = 0;
+		return;
+	}
+	last = first + deleted_nl;
 
 	if (s->count == 1)
 		return;
@@ -3,8 +3,26 @@
 
 #include "buffer.h"
 
-struct hl_color **hl_line(struct buffer *b, const char *line, int len, int line_nr, int *next_changed);
-void hl_fill_start_states(struct buffer *b, int line_nr);
+struct state;
+
+struct hl_span {
+	int start;
+	int len;
+	struct hl_color *color;
+};
+
+// colors of a line, spans are in order and cover the whole line
+struct hl_spans {
+	struct hl_span *spans;
+	int count;
+	int alloc;
+};
+
+struct hl_spans *hl_line(struct buffer *b, const char *line, int len, int line_nr, int *next_changed);
+struct hl_spans *hl_line_guess(struct buffer *b, const char *line, int len, struct state **state);
+bool hl_fill_start_states(struct buffer *b, int line_nr, long usec);
+void hl_reset(struct buffer *b);
+void hl_merge_blocks(struct buffer *b, struct block *next);
 void hl_insert(struct buffer *b, int first, int lines);
 void hl_delete(struct buffer *b, int first, int lines);
 
@@ -1,6 +1,102 @@
 #include "iter.h"
+#include "block-tree.h"
+#include "newline.h"
 #include "common.h"
 
+// smaller blocks and blocks with short lines are scanned
+#define LINE_STARTS_MIN_SIZE 4096
+#define LINE_STARTS_MIN_LINE 256
+
+// number of blocks which can have line start table at the same time
+#define LINE_STARTS_CACHE 64
+
+static struct block *line_starts_cache[LINE_STARTS_CACHE];
+static unsigned int line_starts_next;
+
+/*
+ * Table of nl + 1 offsets. Line n of the block starts at offset
+ * line_starts[n] and last entry is size of the block.
+ *
+ * Built when needed and freed when the block is modified. Only a limited
+ * number of tables is kept so that moving through a huge file does not
+ * use lots of memory.
+ */
+static const long *get_line_starts(struct block *blk)
+{
+	struct block **slot;
+	long *starts;
+	long offset = 0;
+	long i;
+
+	if (blk->line_starts)
+		return blk->line_starts;
+	if (blk->size < LINE_STARTS_MIN_SIZE || blk->nl < 2 || blk->uncounted)
+		return NULL;
+	if (blk->size < blk->nl * LINE_STARTS_MIN_LINE)
+		return NULL;
+
+	slot = &line_starts_cache[line_starts_next++ % LINE_STARTS_CACHE];
+	if (*slot)
+		free_line_starts(*slot);
+	*slot = blk;
+
+	starts = xnew(long, blk->nl + 1);
+	for (i = 0; i < blk->nl; i++) {
+		const unsigned char *nl;
+
+		starts[i] = offset;
+		nl = memchr(blk->data + offset, '\n', blk->size - offset);
+		offset = nl + 1 - blk->data;
+	}
+	starts[i] = blk->size;
+	blk->line_starts = starts;
+	return starts;
+}
+
+// must be called when contents of the block changes or it is freed
+void free_line_starts(struct block *blk)
+{
+	int i;
+
+	if (!blk->line_starts)
+		return;
+
+	for (i = 0; i < LINE_STARTS_CACHE; i++) {
+		if (line_starts_cache[i] == blk) {
+			line_starts_cache[i] = NULL;
+			break;
+		}
+	}
+	free(blk->line_starts);
+	blk->line_starts = NULL;
+}
+
+// offset of beginning of the line containing offset
+static long line_start(struct block *blk, long offset)
+{
+	const long *starts = get_line_starts(blk);
+	long low, high;
+
+	if (!starts) {
+		while (offset && blk->data[offset - 1] != '\n')
+			offset--;
+		return offset;
+	}
+
+	low = 0;
+	high = blk->nl + 1;
+	while (high - low > 1) {
+		long mid = (low + high) / 2;
+
+		if (starts[mid] <= offset) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	return starts[low];
+}
+
 void block_iter_normalize(struct block_iter *bi)
 {
 	struct block *blk = bi->blk;
@@ -77,9 +173,7 @@ long block_iter_prev_line(struct block_iter *bi)
 	long offset = bi->offset;
 	long start = offset;
 
-	while (offset && blk->data[offset - 1] != '\n')
-		offset--;
-
+	offset = line_start(blk, offset);
 	if (!offset) {
 		if (blk->node.prev == bi->head)
 			return 0;
@@ -88,9 +182,7 @@ long block_iter_prev_line(struct block_iter *bi)
 		start += offset;
 	}
 
-	offset--;
-	while (offset && blk->data[offset - 1] != '\n')
-		offset--;
+	offset = line_start(blk, offset - 1);
 	bi->offset = offset;
 	return start - offset;
 }
@@ -108,8 +200,7 @@ long block_iter_bol(struct block_iter *bi)
 	if (bi->blk->nl == 1) {
 		offset = 0;
 	} else {
-		while (offset && bi->blk->data[offset - 1] != '\n')
-			offset--;
+		offset = line_start(bi->blk, offset);
 	}
 
 	ret = bi->offset - offset;
@@ -165,48 +256,33 @@ void block_iter_skip_bytes(struct block_iter *bi, long count)
 
 void block_iter_goto_offset(struct block_iter *bi, long offset)
 {
-	struct block *blk;
+	struct block *blk = block_find_offset(bi->head, &offset);
 
-	list_for_each_entry(blk, bi->head, node) {
-		if (offset <= blk->size) {
-			bi->blk = blk;
-			bi->offset = offset;
-			return;
-		}
-		offset -= blk->size;
+	if (blk) {
+		bi->blk = blk;
+		bi->offset = offset;
 	}
 }
 
 void block_iter_goto_line(struct block_iter *bi, long line)
 {
-	struct block *blk = BLOCK(bi->head->next);
-	long nl = 0;
-
-	while (blk->node.next != bi->head && nl + blk->nl < line) {
-		nl += blk->nl;
-		blk = BLOCK(blk->node.next);
-	}
+	struct block *blk = block_find_line(bi->head, &line);
 
 	bi->blk = blk;
 	bi->offset = 0;
-	while (nl < line) {
-		if (!block_iter_eat_line(bi))
-			break;
-		nl++;
+	if (line > 0 && line <= blk->nl && get_line_starts(blk)) {
+		bi->offset = blk->line_starts[line];
+	} else if (line > 0) {
+		const char *nl = find_nth_nl((const char *)blk->data, blk->size, line);
+
+		// not enough lines in the last block, go to EOF
+		bi->offset = nl ? nl + 1 - (const char *)blk->data : blk->size;
 	}
 }
 
 long block_iter_get_offset(const struct block_iter *bi)
 {
-	struct block *blk;
-	long offset = 0;
-
-	list_for_each_entry(blk, bi->head, node) {
-		if (blk == bi->blk)
-			break;
-		offset += blk->size;
-	}
-	return offset + bi->offset;
+	return block_start_offset(bi->blk) + bi->offset;
 }
 
 bool block_iter_is_bol(const struct block_iter *bi)
@@ -4,11 +4,19 @@
 #include "libc.h"
 #include "list.h"
 
+struct state;
+
 /*
  * struct block always contains whole lines.
  *
  * There's one zero-sized block when the file is empty. Otherwise
  * zero-sized blocks are forbidden.
+ *
+ * alloc is zero if data points to a read-only mapping of the file.
+ * Such blocks must be copied with block_grow() before modifying them.
+ *
+ * nl of an uncounted block is only an estimate, see load_line(). Such
+ * blocks are counted before they are edited or the cursor enters them.
  */
 struct block {
 	struct list_head node;
@@ -16,6 +24,21 @@ struct block {
 	long size;
 	long alloc;
 	long nl;
+	bool uncounted;
+
+	// see block-tree.c
+	struct block *parent;
+	struct block *left;
+	struct block *right;
+	unsigned int prio;
+	long tree_size;
+	long tree_nl;
+
+	// offsets of line starts in big blocks, see get_line_starts()
+	long *line_starts;
+
+	// start state of the first line, NULL if not known, see hl.c
+	struct state *hl_start;
 };
 
 static inline struct block *BLOCK(struct list_head *item)
@@ -48,6 +71,7 @@ static inline void block_iter_eof(struct block_iter *bi)
 	bi->offset = bi->blk->size;
 }
 
+void free_line_starts(struct block *blk);
 void block_iter_normalize(struct block_iter *bi);
 long block_iter_eat_line(struct block_iter *bi);
 long block_iter_next_line(struct block_iter *bi);
@@ -0,0 +1,219 @@
+#include "journal.h"
+#include "buffer.h"
+#include "block-tree.h"
+#include "change.h"
+#include "editor.h"
+#include "error.h"
+#include "load-save.h"
+
+/*
+ * Edits of a buffer are appended to ~/.dex/journal-<hash of filename> so
+ * that they can be recovered if the editor crashes. The journal starts
+ * with identity of the file the edits were made against and is removed
+ * when the buffer is saved or closed.
+ *
+ * Edits are only buffered while editing. They are written when the editor
+ * is idle, JOURNAL_WRITE_SLICE bytes at a time, and synced when the
+ * journal-sync-interval has passed. main_loop() wakes up for the sync
+ * even if there is no input, see journal_sync_delay().
+ */
+
+struct journal_record {
+	long offset;
+	long del;
+	long ins;
+};
+
+static char *journal_filename(const char *filename)
+{
+	unsigned long long hash = fnv1a(FNV1A_INIT, filename, strlen(filename));
+	char name[64];
+
+	snprintf(name, sizeof(name), "journal-%016llx", hash);
+	return editor_file(name);
+}
+
+static char *journal_header(struct buffer *b)
+{
+	return xsprintf("DEXJ %llu %llu %lld %lld\n%s\n",
+		(unsigned long long)b->st.st_dev,
+		(unsigned long long)b->st.st_ino,
+		(long long)b->st.st_size,
+		(long long)b->st.st_mtime,
+		b->abs_filename);
+}
+
+static struct journal *open_journal(struct buffer *b, bool append)
+{
+	char *filename = journal_filename(b->abs_filename);
+	int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+	struct journal *j = xnew0(struct journal, 1);
+
+	j->fd = open(filename, flags, 0600);
+	j->synced = time(NULL);
+	if (j->fd < 0) {
+		error_msg("Error creating journal %s: %s", filename, strerror(errno));
+		j->failed = true;
+	} else {
+		fcntl(j->fd, F_SETFD, FD_CLOEXEC);
+		if (!append) {
+			char *header = journal_header(b);
+			gbuf_add_str(&j->buf, header);
+			free(header);
+		}
+	}
+	free(filename);
+	return j;
+}
+
+static bool write_journal(struct journal *j, const void *buf, long count)
+{
+	if (xwrite(j->fd, buf, count) < 0) {
+		error_msg("Error writing journal: %s", strerror(errno));
+		j->failed = true;
+		return false;
+	}
+	j->unsynced = true;
+	return true;
+}
+
+static bool journal_enabled(struct buffer *b)
+{
+	// edits of files that do not exist yet can't be replayed
+	return options.journal && b->abs_filename && b->st.st_mode;
+}
+
+void journal_edit(struct buffer *b, long offset, long del, const char *ins, long ins_count)
+{
+	struct journal_record rec = { offset, del, ins_count };
+	struct journal *j = b->journal;
+
+	if (!journal_enabled(b))
+		return;
+	if (!j)
+		j = b->journal = open_journal(b, false);
+	if (j->failed)
+		return;
+
+	gbuf_add_buf(&j->buf, (const char *)&rec, sizeof(rec));
+	gbuf_add_buf(&j->buf, ins, ins_count);
+}
+
+// called when idle, returns true if something was written or synced
+bool journal_flush(struct buffer *b)
+{
+	struct journal *j = b->journal;
+
+	if (!j || j->failed)
+		return false;
+
+	if (j->written < j->buf.len) {
+		long count = j->buf.len - j->written;
+
+		if (count > JOURNAL_WRITE_SLICE)
+			count = JOURNAL_WRITE_SLICE;
+		if (write_journal(j, j->buf.buffer + j->written, count))
+			j->written += count;
+		if (j->written == j->buf.len || j->failed) {
+			gbuf_clear(&j->buf);
+			j->written = 0;
+		}
+		return true;
+	}
+	if (j->unsynced && time(NULL) - j->synced >= options.journal_sync_interval) {
+		fsync(j->fd);
+		j->synced = time(NULL);
+		j->unsynced = false;
+		return true;
+	}
+	return false;
+}
+
+// milliseconds until journal_flush() has something to do or -1 if never
+long journal_sync_delay(struct buffer *b)
+{
+	struct journal *j = b->journal;
+	long delay;
+
+	if (!j || j->failed)
+		return -1;
+	if (j->buf.len)
+		return 0;
+	if (!j->unsynced)
+		return -1;
+	delay = j->synced + options.journal_sync_interval - time(NULL);
+	return delay > 0 ? delay * 1000 : 0;
+}
+
+void journal_remove(struct buffer *b)
+{
+	struct journal *j = b->journal;
+
+	if (!j)
+		return;
+	if (j->fd >= 0) {
+		char *filename = journal_filename(b->abs_filename);
+
+		close(j->fd);
+		unlink(filename);
+		free(filename);
+	}
+	gbuf_free(&j->buf);
+	free(j);
+	b->journal = NULL;
+}
+
+// replay journal left by a crashed editor, b must be the current buffer
+void journal_recover(struct buffer *b)
+{
+	char *filename, *header, *buf;
+	long size, hlen, pos, count = 0;
+
+	if (!journal_enabled(b))
+		return;
+
+	filename = journal_filename(b->abs_filename);
+	size = read_file(filename, &buf);
+	if (size <= 0) {
+		free(filename);
+		return;
+	}
+
+	header = journal_header(b);
+	hlen = strlen(header);
+	if (size < hlen || memcmp(buf, header, hlen)) {
+		// edited file has changed, next edit overwrites the journal
+		error_msg("Journal %s does not match the file, not recovered.", filename);
+		goto out;
+	}
+
+	finish_loading(b);
+	begin_change_chain();
+	pos = hlen;
+	while (size - pos >= (long)sizeof(struct journal_record)) {
+		struct journal_record rec;
+
+		memcpy(&rec, buf + pos, sizeof(rec));
+		if (rec.offset < 0 || rec.del < 0 || rec.ins < 0 || (!rec.del && !rec.ins))
+			break;
+		if (rec.ins > size - pos - (long)sizeof(rec))
+			break;
+		if (rec.offset + rec.del > block_tree_size(&b->blocks))
+			break;
+		buffer_replay_edit(rec.offset, rec.del, buf + pos + sizeof(rec), rec.ins);
+		pos += sizeof(rec) + rec.ins;
+		count++;
+	}
+	end_change_chain();
+
+	// partially written edit at end of the journal is dropped
+	if (pos < size && truncate(filename, pos))
+		error_msg("Error truncating journal %s: %s", filename, strerror(errno));
+	b->journal = open_journal(b, true);
+	if (count)
+		info_msg("Recovered %ld changes from journal.", count);
+out:
+	free(header);
+	free(buf);
+	free(filename);
+}
@@ -0,0 +1,29 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "gbuf.h"
+#include "libc.h"
+
+// at most this many bytes are written in one idle slice
+#define JOURNAL_WRITE_SLICE (1L << 20)
+
+struct buffer;
+
+struct journal {
+	int fd;
+	// edits not written yet, bytes before written have been written
+	struct gbuf buf;
+	long written;
+	// time of last fsync() and whether something has been written after it
+	time_t synced;
+	bool unsynced;
+	bool failed;
+};
+
+void journal_edit(struct buffer *b, long offset, long del, const char *ins, long ins_count);
+bool journal_flush(struct buffer *b);
+long journal_sync_delay(struct buffer *b);
+void journal_remove(struct buffer *b);
+void journal_recover(struct buffer *b);
+
+#endif
@@ -2,6 +2,8 @@
 #include "editor.h"
 #include "buffer.h"
 #include "block.h"
+#include "block-tree.h"
+#include "newline.h"
 #include "wbuf.h"
 #include "decoder.h"
 #include "encoder.h"
@@ -9,13 +11,30 @@
 #include "error.h"
 #include "cconv.h"
 #include "path.h"
+#include "uchar.h"
+#include "journal.h"
+#include "view.h"
+#include "hl.h"
+#include "change.h"
+#include "undo-file.h"
 
 #include <sys/mman.h>
 
 static void add_block(struct buffer *b, struct block *blk)
 {
 	b->nl += blk->nl;
-	list_add_before(&blk->node, &b->blocks);
+	block_append(blk, &b->blocks);
+}
+
+// blk is added before pos, or appended if pos is NULL
+static void insert_block(struct buffer *b, struct block *blk, struct block *pos)
+{
+	if (pos) {
+		b->nl += blk->nl;
+		block_insert_before(blk, pos);
+	} else {
+		add_block(b, blk);
+	}
 }
 
 static struct block *add_utf8_line(struct buffer *b, struct block *blk, const unsigned char *line, size_t len)
@@ -32,7 +51,7 @@ static struct block *add_utf8_line(struct buffer *b, struct block *blk, const un
 
 	if (size < 8192)
 		size = 8192;
-	blk = block_new(size);
+	blk = block_new(b, size);
 copy:
 	memcpy(blk->data + blk->size, line, len);
 	blk->size += len;
@@ -41,6 +60,118 @@ copy:
 	return blk;
 }
 
+// index of first non-ASCII byte or size
+static size_t skip_ascii(const unsigned char *buf, size_t size)
+{
+	const unsigned long mask = ~0UL / 0xff * 0x80;
+	size_t i = 0;
+
+	while (size - i >= sizeof(unsigned long)) {
+		unsigned long word;
+
+		memcpy(&word, buf + i, sizeof(word));
+		if (word & mask)
+			break;
+		i += sizeof(word);
+	}
+	while (i < size && buf[i] < 0x80)
+		i++;
+	return i;
+}
+
+/*
+ * UTF-8 (or ASCII) files with LF line endings need no decoding. Blocks
+ * can point directly to the private mapping of the file and are copied
+ * only when edited.
+ *
+ * Looks at the first size bytes. Returns encoding of the file or NULL if
+ * the file must be decoded. If they are all ASCII the rest of a lazily
+ * loaded file is checked slice by slice, see check_slice().
+ */
+static const char *mapped_encoding(struct buffer *b, const unsigned char *buf, size_t size)
+{
+	const unsigned char *end = buf + size;
+	const unsigned char *nl = memchr(buf, '\n', size);
+	const char *e = b->encoding;
+
+	if (e == NULL) {
+		size_t i;
+
+		if (detect_encoding_from_bom(buf, size))
+			return NULL;
+
+		// same heuristics as the decoder
+		i = skip_ascii(buf, size);
+		if (i < size) {
+			const unsigned char *line_end = memchr(buf + i, '\n', size - i);
+			long idx = i;
+
+			if (line_end == NULL)
+				line_end = end;
+			if (!u_is_unicode(u_get_nonascii(buf, line_end - buf, &idx)))
+				return NULL;
+			e = "UTF-8";
+		} else if (streq(charset, "UTF-8")) {
+			e = charset;
+			b->map_ascii = true;
+		} else {
+			// non-ASCII bytes later in the file are in charset
+			return NULL;
+		}
+	} else if (!streq(e, "UTF-8")) {
+		return NULL;
+	}
+
+	// DOS line-endings would have to be stripped
+	if (nl == NULL)
+		nl = end;
+	if (nl > buf && nl[-1] == '\r')
+		return NULL;
+	return e;
+}
+
+// size of at least max bytes of buf rounded up to whole lines
+static size_t slice_end(const unsigned char *buf, size_t size, size_t max)
+{
+	const unsigned char *nl;
+
+	if (size <= max)
+		return size;
+	nl = memchr(buf + max, '\n', size - max);
+	return nl ? nl + 1 - buf : size;
+}
+
+static void add_mapped_blocks(struct buffer *b, unsigned char *buf, size_t size, struct block *before)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		size_t next = size;
+
+		// same size as blocks created by add_utf8_line()
+		if (size - pos > 8192) {
+			const unsigned char *nl = memchr(buf + pos + 8191, '\n', size - pos - 8191);
+			if (nl)
+				next = nl + 1 - buf;
+		}
+		insert_block(b, block_new_mapped(b, buf + pos, next - pos), before);
+		pos = next;
+	}
+}
+
+static struct block *add_decoded_lines(struct buffer *b, struct block *blk, struct file_decoder *dec)
+{
+	char *line;
+	ssize_t len;
+
+	while (file_decoder_read_line(dec, &line, &len)) {
+		if (b->newline == NEWLINE_DOS && len && line[len - 1] == '\r')
+			len--;
+		blk = add_utf8_line(b, blk, line, len);
+	}
+	return blk;
+}
+
 static int decode_and_add_blocks(struct buffer *b, const unsigned char *buf, size_t size)
 {
 	const char *e = detect_encoding_from_bom(buf, size);
@@ -98,12 +229,7 @@ static int decode_and_add_blocks(struct buffer *b, const unsigned char *buf, siz
 			len--;
 		}
 		blk = add_utf8_line(b, blk, line, len);
-
-		while (file_decoder_read_line(dec, &line, &len)) {
-			if (b->newline == NEWLINE_DOS && len && line[len - 1] == '\r')
-				len--;
-			blk = add_utf8_line(b, blk, line, len);
-		}
+		blk = add_decoded_lines(b, blk, dec);
 		if (blk)
 			add_block(b, blk);
 	}
@@ -136,7 +262,30 @@ static int read_blocks(struct buffer *b, int fd)
 			mapped = true;
 		}
 	}
-	if (!mapped) {
+	if (mapped) {
+		size_t end = size;
+		const char *e;
+
+		if (options.lazy_load_size && size >> 20 >= options.lazy_load_size) {
+			// rest is loaded in the background, see load_more()
+			end = slice_end(buf, size, LAZY_LOAD_SLICE);
+		}
+		e = mapped_encoding(b, buf, end);
+		if (e) {
+			if (b->encoding == NULL)
+				b->encoding = xstrdup(e);
+			// freed when the last mapped block is gone
+			b->map = buf;
+			b->map_size = size;
+			b->map_fd = dup(fd);
+			b->map_file_size = size;
+			b->map_mtime = b->st.st_mtime;
+			b->map_loaded = end;
+			add_mapped_blocks(b, buf, end, NULL);
+			return 0;
+		}
+		b->map_ascii = false;
+	} else {
 		ssize_t alloc = map_size;
 		ssize_t pos = 0;
 
@@ -166,6 +315,23 @@ static int read_blocks(struct buffer *b, int fd)
 	return rc;
 }
 
+// Incomplete lines are not allowed because they are special cases and
+// cause lots of trouble.
+static void add_missing_newline(struct buffer *b)
+{
+	struct block *blk = BLOCK(b->blocks.prev);
+
+	if (blk->size && blk->data[blk->size - 1] != '\n') {
+		if (blk->size + 1 > blk->alloc)
+			block_grow(b, blk, blk->size + 1);
+		blk->data[blk->size++] = '\n';
+		blk->nl++;
+		b->nl++;
+		free_line_starts(blk);
+		block_counts_changed(blk);
+	}
+}
+
 int load_buffer(struct buffer *b, bool must_exist, const char *filename)
 {
 	int fd = open(filename, O_RDONLY);
@@ -195,21 +361,10 @@ int load_buffer(struct buffer *b, bool must_exist, const char *filename)
 		close(fd);
 	}
 	if (list_empty(&b->blocks)) {
-		struct block *blk = block_new(1);
-		list_add_before(&blk->node, &b->blocks);
-	} else {
-		// Incomplete lines are not allowed because they are
-		// special cases and cause lots of trouble.
-		struct block *blk = BLOCK(b->blocks.prev);
-		if (blk->size && blk->data[blk->size - 1] != '\n') {
-			if (blk->size == blk->alloc) {
-				blk->alloc = ROUND_UP(blk->size + 1, 64);
-				xrenew(blk->data, blk->alloc);
-			}
-			blk->data[blk->size++] = '\n';
-			blk->nl++;
-			b->nl++;
-		}
+		struct block *blk = block_new(b, 1);
+		block_append(blk, &b->blocks);
+	} else if (!buffer_loading(b)) {
+		add_missing_newline(b);
 	}
 
 	if (b->encoding == NULL)
@@ -217,6 +372,375 @@ int load_buffer(struct buffer *b, bool must_exist, const char *filename)
 	return 0;
 }
 
+/*
+ * Blocks point to the private mapping of the file until they are edited.
+ * Reading the mapping past the end of a truncated file raises SIGBUS and
+ * blocks change under us if the file is rewritten in place. The file is
+ * checked before every key press and slice of background work, see
+ * check_mapping(). If it has changed loading stops and mapped blocks are
+ * cut to the whole lines still in the file. The buffer matches neither
+ * version of the file anymore so it is marked read-only.
+ */
+static bool mapping_changed(struct buffer *b)
+{
+	struct stat st;
+	struct block *blk, *next;
+	bool loading = buffer_loading(b);
+	long i, size;
+
+	if (fstat(b->map_fd, &st) || (st.st_size == b->map_file_size && st.st_mtime == b->map_mtime))
+		return false;
+
+	b->map_file_size = st.st_size;
+	b->map_mtime = st.st_mtime;
+	b->map_loaded = b->map_size;
+	// block_trim_mapped() counts lines of uncounted blocks
+	b->uncounted.count = 0;
+	size = block_tree_size(&b->blocks);
+
+	// offsets after removed lines move, keep cursors inside the buffer
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		if (!v->restore_cursor)
+			v->saved_cursor_offset = block_iter_get_offset(&v->cursor);
+	}
+
+	blk = BLOCK(b->blocks.next);
+	while (&blk->node != &b->blocks) {
+		next = BLOCK(blk->node.next);
+		if (!blk->alloc)
+			block_trim_mapped(b, blk, (long)st.st_size - (blk->data - b->map));
+		blk = next;
+	}
+	if (list_empty(&b->blocks)) {
+		blk = block_new(b, 1);
+		block_append(blk, &b->blocks);
+	}
+
+	if (loading) {
+		error_msg("%s changed on disk while loading. Only %ld lines were loaded.",
+			b->display_filename, b->nl);
+	} else if (block_tree_size(&b->blocks) != size) {
+		error_msg("%s changed on disk. Lines no longer in the file were removed.",
+			b->display_filename);
+	} else {
+		error_msg("%s changed on disk.", b->display_filename);
+	}
+	// saved history is for the old contents
+	free_undo_history(b);
+	if (block_tree_size(&b->blocks) != size) {
+		// offsets of changes are wrong
+		reset_changes(b);
+		size = block_tree_size(&b->blocks);
+	}
+	b->ro = true;
+
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		if (v->saved_cursor_offset > size)
+			v->saved_cursor_offset = size;
+		if (!v->restore_cursor) {
+			v->cursor.head = &b->blocks;
+			block_iter_goto_offset(&v->cursor, v->saved_cursor_offset);
+		}
+		v->selection = SELECT_NONE;
+		v->pos_blk = NULL;
+		v->col_count = 0;
+	}
+	hl_reset(b);
+	mark_all_lines_changed(b);
+	return true;
+}
+
+// returns true if the mapped file has changed, see mapping_changed()
+bool check_mapping(struct buffer *b)
+{
+	return b->map && mapping_changed(b);
+}
+
+/*
+ * Returns false if a slice of a file whose beginning was all ASCII must
+ * be decoded. Same heuristics as mapped_encoding() and the decoder: the
+ * first non-ASCII line decides.
+ */
+static bool check_slice(struct buffer *b, const unsigned char *buf, size_t size)
+{
+	size_t i = skip_ascii(buf, size);
+	const unsigned char *line_end;
+	long idx = i;
+
+	if (i == size)
+		return true;
+	b->map_ascii = false;
+	line_end = memchr(buf + i, '\n', size - i);
+	if (line_end == NULL)
+		line_end = buf + size;
+	return u_is_unicode(u_get_nonascii(buf, line_end - buf, &idx));
+}
+
+// decode rest of a lazily loaded file like decode_and_add_blocks() would have
+static void decode_rest(struct buffer *b)
+{
+	unsigned char *buf = b->map + b->map_loaded;
+	struct file_decoder *dec = new_file_decoder(NULL, buf, b->map_size - b->map_loaded);
+	struct block *blk = add_decoded_lines(b, NULL, dec);
+
+	if (blk)
+		add_block(b, blk);
+	if (dec->encoding) {
+		free(b->encoding);
+		b->encoding = xstrdup(dec->encoding);
+	}
+	free_file_decoder(dec);
+	b->map_loaded = b->map_size;
+}
+
+/*
+ * Lines far past the loaded part of a big file are found without counting
+ * the lines before them, see load_line(). Lines of the rest of the file
+ * are counted only around the line. Lines of the rest of it are estimated
+ * from the average line length and counted in the background, or when
+ * the cursor moves to them or they are edited. Parts that would be left
+ * uncounted are counted at the same time if they are smaller than this.
+ */
+#define COUNT_MARGIN (LAZY_LOAD_SLICE / 2)
+
+static long line_begin(const unsigned char *buf, long pos)
+{
+	while (pos > 0 && buf[pos - 1] != '\n')
+		pos--;
+	return pos;
+}
+
+/*
+ * Count lines of uncounted block b->uncounted.ptrs[idx] around bytes
+ * offset..offset + len. line_nr is the estimated number of lines in the
+ * block before the line containing offset. The estimate for the rest is
+ * kept so that lines after the block do not move unless the estimate
+ * was too small.
+ */
+static void count_lines_around(struct buffer *b, long idx, long offset, long len, long line_nr)
+{
+	struct block *blk = b->uncounted.ptrs[idx];
+	struct block *next = NULL, *rest;
+	unsigned char *data = blk->data;
+	long size = blk->size;
+	long est = blk->nl;
+	long line = block_start_line(blk);
+	long start = offset - COUNT_MARGIN;
+	long end = offset + len + COUNT_MARGIN;
+	long before = 0, after = 0, nl, i;
+
+	if (blk->node.next != &b->blocks)
+		next = BLOCK(blk->node.next);
+	if (start < COUNT_MARGIN) {
+		start = 0;
+	} else {
+		start = line_begin(data, start);
+		before = line_nr - count_nl((const char *)data + start, line_begin(data, offset) - start);
+		if (before < 2)
+			before = 2;
+	}
+	if (end > size - COUNT_MARGIN) {
+		end = size;
+	} else {
+		end = slice_end(data + start, size - start, end - start) + start;
+	}
+
+	// cursors in the block are moved to the new blocks
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		if (!v->restore_cursor && v->cursor.blk == blk)
+			v->saved_cursor_offset = block_iter_get_offset(&v->cursor);
+	}
+
+	nl = b->nl;
+	add_mapped_blocks(b, data + start, end - start, next);
+	nl = b->nl - nl;
+	if (end < size) {
+		after = est - before - nl;
+		if (after < 2)
+			after = 2;
+		rest = block_new_uncounted(b, data + end, size - end, after);
+		insert_block(b, rest, next);
+		ptr_array_insert(&b->uncounted, rest, idx + 1);
+	}
+	if (!start) {
+		// first line of the block did not move
+		BLOCK(blk->node.next)->hl_start = blk->hl_start;
+		ptr_array_remove_idx(&b->uncounted, idx);
+	}
+	block_cut_uncounted(b, blk, start, before);
+
+	if (b->map_ascii) {
+		// the first non-ASCII line might have been skipped
+		check_slice(b, data + start, end - start);
+	}
+
+	// lines after the block move if the estimate was wrong
+	nl += before + after - est;
+	for (i = 0; i < b->views.count; i++) {
+		struct view *v = b->views.ptrs[i];
+
+		if (!v->restore_cursor && v->cursor.blk == blk)
+			block_iter_goto_offset(&v->cursor, v->saved_cursor_offset);
+		if (v->vy > line + est)
+			v->vy += nl;
+		v->pos_blk = NULL;
+	}
+	buffer_mark_lines_changed(b, line, INT_MAX);
+}
+
+/*
+ * Add the rest of the file as an uncounted block if line is far past the
+ * loaded part. Returns false if the lines before it should be counted.
+ */
+static bool skip_lines(struct buffer *b, long line)
+{
+	unsigned char *buf = b->map + b->map_loaded;
+	long nl = b->nl ? b->nl : 1;
+	long avg = b->map_loaded / nl;
+	long size = b->map_size - b->map_loaded;
+	struct block *blk;
+
+	if (!avg || (double)(line - b->nl) * avg < 4 * COUNT_MARGIN)
+		return false;
+
+	// last line may lack newline
+	size = line_begin(buf, size);
+	if (size < 4 * COUNT_MARGIN)
+		return false;
+
+	// see hash_skipped()
+	b->undo_hashed = b->map_loaded;
+	nl = b->nl;
+	blk = block_new_uncounted(b, buf, size, size / avg < 2 ? 2 : size / avg);
+	add_block(b, blk);
+	ptr_array_add(&b->uncounted, blk);
+	add_mapped_blocks(b, buf + size, b->map_size - b->map_loaded - size, NULL);
+	b->map_loaded = b->map_size;
+	add_missing_newline(b);
+	buffer_mark_lines_changed(b, nl, INT_MAX);
+	return true;
+}
+
+// index of uncounted block containing beginning of line, -1 if none
+static long find_uncounted_line(struct buffer *b, long line)
+{
+	long i;
+
+	for (i = 0; i < b->uncounted.count; i++) {
+		struct block *blk = b->uncounted.ptrs[i];
+		long start = block_start_line(blk);
+
+		if (start < line && line < start + blk->nl)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Make sure the buffer contains line line (1-based). Its lines are
+ * counted unless it is far past the loaded part of a big file. Then its
+ * position is estimated and its number stays approximate until
+ * load_more() has counted the lines before it.
+ */
+void load_line(struct buffer *b, long line)
+{
+	long idx;
+
+	if (b->map_loaded < b->map_size && !skip_lines(b, line))
+		load_lines(b, line);
+
+	idx = find_uncounted_line(b, line - 1);
+	if (idx >= 0) {
+		struct block *blk = b->uncounted.ptrs[idx];
+		long nl = line - 1 - block_start_line(blk);
+		long offset = (double)nl * blk->size / blk->nl;
+
+		count_lines_around(b, idx, line_begin(blk->data, offset), 0, nl);
+	}
+}
+
+/*
+ * Count uncounted lines of bytes offset..offset + len of the buffer
+ * before they are edited or the cursor moves to them.
+ */
+void count_lines(struct buffer *b, long offset, long len)
+{
+	long i = 0;
+
+	while (i < b->uncounted.count) {
+		struct block *blk = b->uncounted.ptrs[i];
+		long start = block_start_offset(blk);
+		long end = start + blk->size;
+
+		if (start > offset + len)
+			break;
+		if (end < offset) {
+			i++;
+			continue;
+		}
+		start = offset > start ? offset - start : 0;
+		end = offset + len < end ? offset + len - block_start_offset(blk) : blk->size;
+		count_lines_around(b, i, start, end - start, (double)blk->nl * start / blk->size);
+	}
+}
+
+/*
+ * Add next max bytes, rounded up to whole lines, of a file that is
+ * being loaded lazily, or count lines of the first uncounted block.
+ * Returns true if there is still more to do.
+ */
+bool load_more(struct buffer *b, size_t max)
+{
+	unsigned char *buf = b->map + b->map_loaded;
+	struct list_head *tail = b->blocks.prev;
+	long nl = b->nl;
+	size_t end;
+
+	if (!buffer_loading(b) || mapping_changed(b))
+		return false;
+
+	if (b->uncounted.count) {
+		count_lines_around(b, 0, 0, 0, 0);
+		hash_skipped(b);
+		return buffer_loading(b);
+	}
+
+	end = slice_end(buf, b->map_size - b->map_loaded, max);
+	if (b->map_ascii && !check_slice(b, buf, end)) {
+		decode_rest(b);
+	} else {
+		add_mapped_blocks(b, buf, end, NULL);
+		b->map_loaded += end;
+	}
+	if (!buffer_loading(b))
+		add_missing_newline(b);
+	hash_loaded_blocks(b, tail->next);
+
+	// lines after the old end of the buffer
+	buffer_mark_lines_changed(b, nl, INT_MAX);
+	return buffer_loading(b);
+}
+
+// make sure the buffer has at least nl lines, if the file has them
+void load_lines(struct buffer *b, long nl)
+{
+	// only the end of the file is loaded, see load_line()
+	while (b->nl < nl && b->map_loaded < b->map_size && load_more(b, LAZY_LOAD_SLICE))
+		;
+}
+
+void finish_loading(struct buffer *b)
+{
+	while (load_more(b, b->map_size))
+		;
+}
+
 static char *tmp_filename(const char *filename)
 {
 	char *tmp, *dir = path_dirname(filename);
@@ -273,6 +797,8 @@ int save_buffer(struct buffer *b, const char *filename, const char *encoding, en
 	char *tmp = NULL;
 	int fd;
 
+	finish_loading(b);
+
 	// Don't use temporary file when saving file in /tmp because
 	// crontab command doesn't like the file to be replaced.
 	if (!str_has_prefix(filename, "/tmp/")) {
@@ -307,6 +833,8 @@ int save_buffer(struct buffer *b, const char *filename, const char *encoding, en
 			// New file.
 			mode = 0666 & ~get_umask();
 		}
+		// Truncating a mapped file would pull the blocks from under us.
+		unmap_blocks(b);
 		fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, mode);
 		if (fd < 0) {
 			error_msg("Error opening file: %s", strerror(errno));
@@ -336,6 +864,7 @@ int save_buffer(struct buffer *b, const char *filename, const char *encoding, en
 	free_file_encoder(enc);
 	free(tmp);
 	stat(filename, &b->st);
+	journal_remove(b);
 	return 0;
 error:
 	if (enc != NULL)
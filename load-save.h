@@ -3,7 +3,16 @@
 
 #include "buffer.h"
 
+// big files are loaded in pieces of this size, see lazy-load-size option
+#define LAZY_LOAD_SLICE (16L << 20)
+
 int load_buffer(struct buffer *b, bool must_exist, const char *filename);
+bool load_more(struct buffer *b, size_t max);
+void load_lines(struct buffer *b, long nl);
+void load_line(struct buffer *b, long line);
+void count_lines(struct buffer *b, long offset, long len);
+void finish_loading(struct buffer *b);
+bool check_mapping(struct buffer *b);
 int save_buffer(struct buffer *b, const char *filename, const char *encoding, enum newline_sequence newline);
 
 #endif
@@ -11,6 +11,7 @@
 #include "file-history.h"
 #include "search.h"
 #include "error.h"
+#include "newline.h"
 
 #include <locale.h>
 #include <langinfo.h>
@@ -144,6 +145,7 @@ int main(int argc, char *argv[])
 	charset = nl_langinfo(CODESET);
 	if (streq(charset, "UTF-8"))
 		term_utf8 = true;
+	init_nl_kernels();
 
 	exec_builtin_rc(builtin_rc);
 	fill_builtin_colors();
@@ -1,6 +1,7 @@
 #include "move.h"
 #include "view.h"
 #include "buffer.h"
+#include "load-save.h"
 #include "indent.h"
 #include "uchar.h"
 
@@ -144,12 +145,14 @@ void move_bof(void)
 
 void move_eof(void)
 {
+	finish_loading(buffer);
 	block_iter_eof(&view->cursor);
 	view_reset_preferred_x(view);
 }
 
 void move_to_line(struct view *v, int line)
 {
+	load_line(v->buffer, line);
 	block_iter_goto_line(&v->cursor, line - 1);
 	v->center_on_scroll = true;
 }
@@ -0,0 +1,282 @@
+#include "newline.h"
+#include "common.h"
+
+/*
+ * Newline counting and searching is done for every edit and when moving
+ * around in big files. Vectorized versions are selected at runtime if the
+ * CPU supports them.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+static bool scalar_supported(void)
+{
+	return true;
+}
+
+static long count_nl_scalar(const char *buf, long size)
+{
+	const char *end = buf + size;
+	long nl = 0;
+
+	while (buf < end) {
+		buf = memchr(buf, '\n', end - buf);
+		if (!buf)
+			break;
+		buf++;
+		nl++;
+	}
+	return nl;
+}
+
+static long copy_count_nl_scalar(char *dst, const char *src, long len)
+{
+	long i, nl = 0;
+	for (i = 0; i < len; i++) {
+		dst[i] = src[i];
+		if (src[i] == '\n')
+			nl++;
+	}
+	return nl;
+}
+
+// returns pointer to nth (1 based) newline or NULL, also if n <= 0
+static const char *find_nth_nl_scalar(const char *buf, long size, long n)
+{
+	const char *end = buf + size;
+
+	if (n <= 0)
+		return NULL;
+	while (buf < end) {
+		const char *nl = memchr(buf, '\n', end - buf);
+
+		if (!nl)
+			break;
+		if (--n == 0)
+			return nl;
+		buf = nl + 1;
+	}
+	return NULL;
+}
+
+#if HAVE_X86_KERNELS
+
+// nth (1 based) set bit of mask, mask must have at least n bits set
+static inline int nth_bit(unsigned int mask, long n)
+{
+	while (--n)
+		mask &= mask - 1;
+	return __builtin_ctz(mask);
+}
+
+__attribute__((target("sse2")))
+static bool sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static long sum_bytes_sse2(__m128i acc)
+{
+	long long sum[2];
+
+	_mm_storeu_si128((__m128i *)sum, _mm_sad_epu8(acc, _mm_setzero_si128()));
+	return sum[0] + sum[1];
+}
+
+__attribute__((target("sse2")))
+static long count_nl_sse2(const char *buf, long size)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	long count = 0;
+	long i = 0;
+
+	while (size - i >= 16) {
+		// byte counters overflow after 255 iterations
+		long n = (size - i) / 16;
+		__m128i acc = _mm_setzero_si128();
+
+		if (n > 255)
+			n = 255;
+		while (n--) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+			i += 16;
+		}
+		count += sum_bytes_sse2(acc);
+	}
+	return count + count_nl_scalar(buf + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static long copy_count_nl_sse2(char *dst, const char *src, long size)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	long count = 0;
+	long i = 0;
+
+	while (size - i >= 16) {
+		long n = (size - i) / 16;
+		__m128i acc = _mm_setzero_si128();
+
+		if (n > 255)
+			n = 255;
+		while (n--) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i), v);
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+			i += 16;
+		}
+		count += sum_bytes_sse2(acc);
+	}
+	return count + copy_count_nl_scalar(dst + i, src + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static const char *find_nth_nl_sse2(const char *buf, long size, long n)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	long i = 0;
+
+	if (n <= 0)
+		return NULL;
+	while (size - i >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		int count = __builtin_popcount(mask);
+
+		if (count >= n)
+			return buf + i + nth_bit(mask, n);
+		n -= count;
+		i += 16;
+	}
+	return find_nth_nl_scalar(buf + i, size - i, n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static bool avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+__attribute__((target("avx2,popcnt")))
+static long sum_bytes_avx2(__m256i acc)
+{
+	long long sum[4];
+
+	_mm256_storeu_si256((__m256i *)sum, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+	return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+__attribute__((target("avx2,popcnt")))
+static long count_nl_avx2(const char *buf, long size)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	long count = 0;
+	long i = 0;
+
+	while (size - i >= 32) {
+		long n = (size - i) / 32;
+		__m256i acc = _mm256_setzero_si256();
+
+		if (n > 255)
+			n = 255;
+		while (n--) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+			i += 32;
+		}
+		count += sum_bytes_avx2(acc);
+	}
+	return count + count_nl_scalar(buf + i, size - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static long copy_count_nl_avx2(char *dst, const char *src, long size)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	long count = 0;
+	long i = 0;
+
+	while (size - i >= 32) {
+		long n = (size - i) / 32;
+		__m256i acc = _mm256_setzero_si256();
+
+		if (n > 255)
+			n = 255;
+		while (n--) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+			_mm256_storeu_si256((__m256i *)(dst + i), v);
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+			i += 32;
+		}
+		count += sum_bytes_avx2(acc);
+	}
+	return count + copy_count_nl_scalar(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char *find_nth_nl_avx2(const char *buf, long size, long n)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	long i = 0;
+
+	if (n <= 0)
+		return NULL;
+	while (size - i >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		int count = __builtin_popcount(mask);
+
+		if (count >= n)
+			return buf + i + nth_bit(mask, n);
+		n -= count;
+		i += 32;
+	}
+	return find_nth_nl_scalar(buf + i, size - i, n);
+}
+
+#endif
+
+const struct nl_kernels nl_kernels[] = {
+	{ "scalar", scalar_supported, count_nl_scalar, copy_count_nl_scalar, find_nth_nl_scalar },
+#if HAVE_X86_KERNELS
+	{ "sse2", sse2_supported, count_nl_sse2, copy_count_nl_sse2, find_nth_nl_sse2 },
+	{ "avx2", avx2_supported, count_nl_avx2, copy_count_nl_avx2, find_nth_nl_avx2 },
+#endif
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+// scalar until init_nl_kernels() is called
+static const struct nl_kernels *kernels = &nl_kernels[0];
+
+// last supported entry is the best
+void init_nl_kernels(void)
+{
+	const struct nl_kernels *k;
+
+	for (k = nl_kernels + 1; k->name; k++) {
+		if (k->supported())
+			kernels = k;
+	}
+}
+
+long count_nl(const char *buf, long size)
+{
+	return kernels->count(buf, size);
+}
+
+long copy_count_nl(char *dst, const char *src, long size)
+{
+	return kernels->copy_count(dst, src, size);
+}
+
+const char *find_nth_nl(const char *buf, long size, long n)
+{
+	return kernels->find_nth(buf, size, n);
+}
@@ -0,0 +1,23 @@
+#ifndef NEWLINE_H
+#define NEWLINE_H
+
+#include "libc.h"
+
+struct nl_kernels {
+	const char *name;
+	bool (*supported)(void);
+	long (*count)(const char *buf, long size);
+	long (*copy_count)(char *dst, const char *src, long size);
+	const char *(*find_nth)(const char *buf, long size, long n);
+};
+
+// all implementations, scalar first, terminated by NULL name
+extern const struct nl_kernels nl_kernels[];
+
+// selects the best kernels the CPU supports, call once at startup
+void init_nl_kernels(void);
+long count_nl(const char *buf, long size);
+long copy_count_nl(char *dst, const char *src, long size);
+const char *find_nth_nl(const char *buf, long size, long n);
+
+#endif
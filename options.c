@@ -23,8 +23,13 @@ struct global_options options = {
 	.case_sensitive_search = CSS_TRUE,
 	.display_special = 0,
 	.esc_timeout = 100,
+	.highlight_slice = 10000,
+	.journal = 1,
+	.journal_sync_interval = 5,
+	.lazy_load_size = 256,
 	.lock_files = 1,
 	.newline = NEWLINE_UNIX,
+	.persistent_undo = 1,
 	.scroll_margin = 0,
 	.show_line_numbers = 0,
 	.statusline_left = NULL,
@@ -32,6 +37,7 @@ struct global_options options = {
 	.tab_bar = TAB_BAR_HORIZONTAL,
 	.tab_bar_max_components = 0,
 	.tab_bar_width = 25,
+	.undo_memory_size = 64,
 };
 
 enum option_type {
@@ -397,10 +403,15 @@ static const struct option_desc option_desc[] = {
 	BOOL_OPT("expand-tab", C(expand_tab), NULL),
 	BOOL_OPT("file-history", C(file_history), NULL),
 	STR_OPT("filetype", L(filetype), validate_filetype, filetype_changed),
+	INT_OPT("highlight-slice", G(highlight_slice), 0, 1000000, NULL),
 	INT_OPT("indent-width", C(indent_width), 1, 8, NULL),
 	STR_OPT("indent-regex", L(indent_regex), validate_regex, NULL),
+	BOOL_OPT("journal", G(journal), NULL),
+	INT_OPT("journal-sync-interval", G(journal_sync_interval), 0, 3600, NULL),
+	INT_OPT("lazy-load-size", G(lazy_load_size), 0, 1024 * 1024, NULL),
 	BOOL_OPT("lock-files", G(lock_files), NULL),
 	ENUM_OPT("newline", G(newline), newline_enum, NULL),
+	BOOL_OPT("persistent-undo", G(persistent_undo), NULL),
 	INT_OPT("scroll-margin", G(scroll_margin), 0, 100, NULL),
 	BOOL_OPT("show-line-numbers", G(show_line_numbers), NULL),
 	STR_OPT("statusline-left", G(statusline_left), validate_statusline_format, NULL),
@@ -411,6 +422,7 @@ static const struct option_desc option_desc[] = {
 	INT_OPT("tab-bar-width", G(tab_bar_width), TAB_BAR_MIN_WIDTH, 100, NULL),
 	INT_OPT("tab-width", C(tab_width), 1, 8, NULL),
 	INT_OPT("text-width", C(text_width), 1, 1000, NULL),
+	INT_OPT("undo-memory-size", G(undo_memory_size), 0, 1024 * 1024, NULL),
 	FLAG_OPT("ws-error", C(ws_error), ws_error_values, NULL),
 };
 
@@ -95,8 +95,13 @@ struct global_options {
 	enum case_sensitive_search case_sensitive_search;
 	int display_special;
 	int esc_timeout;
+	int highlight_slice;
+	int journal;
+	int journal_sync_interval;
+	int lazy_load_size;
 	int lock_files;
 	enum newline_sequence newline; // default value for new files
+	int persistent_undo;
 	int scroll_margin;
 	int show_line_numbers;
 	char *statusline_left;
@@ -104,6 +109,7 @@ struct global_options {
 	enum tab_bar tab_bar;
 	int tab_bar_max_components;
 	int tab_bar_width;
+	int undo_memory_size;
 };
 
 extern struct global_options options;
@@ -17,7 +17,11 @@ struct line_info {
 	long pos;
 	long indent_size;
 	long trailing_ws_offset;
-	struct hl_color **colors;
+
+	// colors from the syntax highlighter, span is index of current span
+	struct hl_span *spans;
+	int nr_spans;
+	int span;
 };
 
 static bool is_default_bg_color(int color)
@@ -141,8 +145,11 @@ static unsigned int screen_next_char(struct line_info *info)
 			ws_error = true;
 	}
 
-	if (info->colors && info->colors[pos]) {
-		color = info->colors[pos]->color;
+	// pos only increases while printing the line
+	while (info->span < info->nr_spans && pos >= info->spans[info->span].start + info->spans[info->span].len)
+		info->span++;
+	if (info->span < info->nr_spans && info->spans[info->span].color) {
+		color = info->spans[info->span].color->color;
 	} else {
 		color = *builtin_colors[BC_DEFAULT];
 	}
@@ -194,43 +201,76 @@ static bool is_notice(const char *word, int len)
 	return false;
 }
 
+static void add_span(struct hl_spans *s, int start, int end, struct hl_color *color)
+{
+	struct hl_span *span;
+
+	if (start == end)
+		return;
+	if (s->count == s->alloc) {
+		s->alloc = ROUND_UP(s->count + 1, 64);
+		xrenew(s->spans, s->alloc);
+	}
+	span = &s->spans[s->count++];
+	span->start = start;
+	span->len = end - start;
+	span->color = color;
+}
+
 // highlight certain words inside comments
 static void hl_words(struct line_info *info)
 {
+	static struct hl_spans words;
 	struct hl_color *cc = find_color("comment");
 	struct hl_color *nc = find_color("notice");
-	int i, j, si, max;
+	bool found = false;
+	int i, max;
 
-	if (info->colors == NULL || cc == NULL || nc == NULL)
+	if (info->spans == NULL || cc == NULL || nc == NULL)
 		return;
 
-	i = info->pos;
-	if (i >= info->size)
+	if (info->pos >= info->size)
 		return;
 
-	// go to beginning of partially visible word inside comment
-	while (i > 0 && info->colors[i] == cc && is_word_byte(info->line[i]))
-		i--;
-
 	// This should be more than enough. I'm too lazy to iterate characters
 	// instead of bytes and calculate text width.
 	max = info->pos + screen_w * 4 + 8;
 
-	while (i < info->size) {
-		if (info->colors[i] != cc || !is_word_byte(info->line[i])) {
-			if (i > max)
-				break;
-			i++;
-		} else {
-			// beginning of a word inside comment
-			si = i++;
-			while (i < info->size && info->colors[i] == cc && is_word_byte(info->line[i]))
-				i++;
-			if (is_notice(info->line + si, i - si)) {
-				for (j = si; j < i; j++)
-					info->colors[j] = nc;
+	words.count = 0;
+	for (i = 0; i < info->nr_spans; i++) {
+		const struct hl_span *span = &info->spans[i];
+		int start = span->start;
+		int end = start + span->len;
+		int pos = start, j = start;
+
+		if (span->color != cc || end <= info->pos || start > max) {
+			add_span(&words, start, end, span->color);
+			continue;
+		}
+
+		// split comment at notice words that are at least partially visible
+		while (j < end && j <= max) {
+			int si;
+
+			if (!is_word_byte(info->line[j])) {
+				j++;
+				continue;
+			}
+			si = j++;
+			while (j < end && is_word_byte(info->line[j]))
+				j++;
+			if (j > info->pos && is_notice(info->line + si, j - si)) {
+				add_span(&words, pos, si, cc);
+				add_span(&words, si, j, nc);
+				pos = j;
+				found = true;
 			}
 		}
+		add_span(&words, pos, end, cc);
+	}
+	if (found) {
+		info->spans = words.spans;
+		info->nr_spans = words.count;
 	}
 }
 
@@ -258,7 +298,7 @@ static void line_info_init(struct line_info *info, struct view *v, struct block_
 	}
 }
 
-static void line_info_set_line(struct line_info *info, struct lineref *lr, struct hl_color **colors)
+static void line_info_set_line(struct line_info *info, struct lineref *lr, struct hl_spans *colors)
 {
 	int i;
 
@@ -268,7 +308,13 @@ static void line_info_set_line(struct line_info *info, struct lineref *lr, struc
 	info->line = lr->line;
 	info->size = lr->size - 1;
 	info->pos = 0;
-	info->colors = colors;
+	info->spans = NULL;
+	info->nr_spans = 0;
+	info->span = 0;
+	if (colors) {
+		info->spans = colors->spans;
+		info->nr_spans = colors->count;
+	}
 
 	for (i = 0; i < info->size; i++) {
 		char ch = info->line[i];
@@ -297,6 +343,15 @@ static void print_line(struct line_info *info)
 	//
 	// There can be a wide character (tab, control code etc.) which is
 	// partially visible and can't be skipped using screen_skip_char().
+	if (info->size >= COLUMN_CHECKPOINT && obuf.scroll_x > 8 && info->line_nr == info->view->cy) {
+		// only cursor line to avoid thrashing the checkpoints
+		const struct column_checkpoint *cp = view_get_columns(info->view,
+			info->line, info->size, info->offset, info->size, obuf.scroll_x - 9);
+
+		info->pos = cp->idx;
+		info->offset += cp->idx;
+		obuf.x = cp->x_display;
+	}
 	while (obuf.x + 8 < obuf.scroll_x && info->pos < info->size)
 		screen_skip_char(info);
 
@@ -332,6 +387,8 @@ void update_range(struct view *v, int y1, int y2)
 {
 	struct line_info info;
 	struct block_iter bi = v->cursor;
+	struct state *guess = NULL;
+	bool known;
 	int i, got_line;
 
 	buf_reset(v->window->edit_x, v->window->edit_w, v->vx);
@@ -350,17 +407,26 @@ void update_range(struct view *v, int y1, int y2)
 	y2 -= v->vy;
 
 	got_line = !block_iter_is_eof(&bi);
-	hl_fill_start_states(v->buffer, info.line_nr);
+	known = hl_fill_start_states(v->buffer, info.line_nr, options.highlight_slice);
+	if (!known && v->buffer->hl_goal < info.line_nr) {
+		// draw with guessed states now, repaint when they are known
+		v->buffer->hl_goal = info.line_nr;
+	}
 	for (i = y1; got_line && i < y2; i++) {
 		struct lineref lr;
-		struct hl_color **colors;
+		struct hl_spans *colors;
 		int next_changed;
 
 		obuf.x = 0;
 		buf_move_cursor(v->window->edit_x, v->window->edit_y + i);
 
 		fill_line_nl_ref(&bi, &lr);
-		colors = hl_line(v->buffer, lr.line, lr.size, info.line_nr, &next_changed);
+		if (known) {
+			colors = hl_line(v->buffer, lr.line, lr.size, info.line_nr, &next_changed);
+		} else {
+			colors = hl_line_guess(v->buffer, lr.line, lr.size, &guess);
+			next_changed = 0;
+		}
 		line_info_set_line(&info, &lr, colors);
 		print_line(&info);
 
@@ -3,18 +3,212 @@
 #include "view.h"
 #include "editor.h"
 #include "change.h"
+#include "load-save.h"
 #include "error.h"
 #include "edit.h"
 #include "gbuf.h"
 #include "regexp.h"
 #include "selection.h"
+#include "block.h"
 
 #define MAX_SUBSTRINGS 32
 
-static bool do_search_fwd(regex_t *regex, struct block_iter *bi, bool skip)
+/*
+ * Pattern without special characters is searched with memchr() and
+ * memcmp() instead of regexec(). It can't match a newline so matches
+ * never span lines or blocks.
+ */
+struct literal {
+	char *str;
+	long len;
+	// index of byte searched with memchr(), preferably a rare one
+	long anchor;
+	// str is lowercase, only ASCII is supported
+	bool icase;
+};
+
+struct matcher {
+	regex_t re;
+	struct literal lit;
+	bool literal;
+};
+
+static bool init_literal(struct literal *lit, const char *pattern, bool icase)
+{
+	long i, len = strlen(pattern);
+
+	if (len == 0)
+		return false;
+	for (i = 0; i < len; i++) {
+		unsigned char ch = pattern[i];
+
+		if (is_regex_special(ch) || ch == '\n')
+			return false;
+		if (icase && ch >= 0x80)
+			return false;
+	}
+
+	lit->str = xmemdup(pattern, len);
+	lit->len = len;
+	lit->anchor = 0;
+	lit->icase = icase;
+	for (i = 0; icase && i < len; i++)
+		lit->str[i] = tolower(lit->str[i]);
+
+	// lowercase letters and spaces are the most common bytes in text
+	for (i = 0; i < len; i++) {
+		if (lit->str[i] != ' ' && !islower(lit->str[i])) {
+			lit->anchor = i;
+			break;
+		}
+	}
+	return true;
+}
+
+static bool literal_matches(const struct literal *lit, const unsigned char *buf)
+{
+	long i, last = lit->len - 1;
+
+	if (!lit->icase)
+		return buf[last] == (unsigned char)lit->str[last] && !memcmp(buf, lit->str, lit->len);
+
+	for (i = last; i >= 0; i--) {
+		if (tolower(buf[i]) != lit->str[i])
+			return false;
+	}
+	return true;
+}
+
+static long find_byte(const unsigned char *buf, long pos, long end, int ch)
+{
+	const unsigned char *p = memchr(buf + pos, ch, end - pos);
+	return p ? p - buf : end;
+}
+
+// returns offset of first match or -1
+static long find_literal(const struct literal *lit, const unsigned char *buf, long size)
+{
+	long k = lit->anchor;
+	int ch = (unsigned char)lit->str[k];
+	// anchor byte of a match is before this
+	long end = size - lit->len + k + 1;
+	// next positions of anchor byte and its uppercase version
+	long a = -1, b = -1;
+	long pos = k;
+
+	if (!lit->icase || !islower(ch))
+		b = end;
+	while (pos < end) {
+		long i;
+
+		if (a < pos)
+			a = find_byte(buf, pos, end, ch);
+		if (b < pos)
+			b = find_byte(buf, pos, end, toupper(ch));
+		i = a < b ? a : b;
+		if (i == end)
+			break;
+		if (literal_matches(lit, buf + i - k))
+			return i - k;
+		pos = i + 1;
+	}
+	return -1;
+}
+
+// literal match looks like regexec() match without subexpressions
+static void literal_match(regmatch_t *m, long nr_m, long so, long len)
+{
+	long i;
+
+	m[0].rm_so = so;
+	m[0].rm_eo = so + len;
+	for (i = 1; i < nr_m; i++) {
+		m[i].rm_so = -1;
+		m[i].rm_eo = -1;
+	}
+}
+
+static bool matcher_compile(struct matcher *m, const char *pattern, int re_flags, bool basic)
+{
+	m->literal = init_literal(&m->lit, pattern, re_flags & REG_ICASE);
+	if (m->literal)
+		return true;
+	if (basic)
+		return regexp_compile_basic(&m->re, pattern, re_flags);
+	return regexp_compile(&m->re, pattern, re_flags);
+}
+
+static void matcher_free(struct matcher *m)
+{
+	if (m->literal) {
+		free(m->lit.str);
+	} else {
+		regfree(&m->re);
+	}
+}
+
+// like regexp_exec()
+static bool matcher_exec(const struct matcher *m, const char *buf, long size, long nr_m, regmatch_t *match, int eflags)
+{
+	long so;
+
+	if (!m->literal)
+		return regexp_exec(&m->re, buf, size, nr_m, match, eflags);
+
+	so = find_literal(&m->lit, (const unsigned char *)buf, size);
+	if (so < 0)
+		return false;
+	literal_match(match, nr_m, so, m->lit.len);
+	return true;
+}
+
+static void found_match(struct block_iter *bi)
+{
+	view->cursor = *bi;
+	view->center_on_scroll = true;
+	view_reset_preferred_x(view);
+}
+
+// searches block data directly, lines don't matter
+static bool literal_search_fwd(const struct literal *lit, struct block_iter *bi, bool skip)
+{
+	struct block *blk;
+	long offset;
+
+	block_iter_normalize(bi);
+	blk = bi->blk;
+	offset = bi->offset;
+
+	while (1) {
+		long so = find_literal(lit, blk->data + offset, blk->size - offset);
+
+		if (so >= 0) {
+			if (skip && so == 0) {
+				// ignore match at cursor position
+				offset += lit->len;
+				skip = false;
+				continue;
+			}
+			bi->blk = blk;
+			bi->offset = offset + so;
+			found_match(bi);
+			return true;
+		}
+		if (blk->node.next == bi->head)
+			return false;
+		blk = BLOCK(blk->node.next);
+		offset = 0;
+		skip = false;
+	}
+}
+
+static bool do_search_fwd(const struct matcher *m, struct block_iter *bi, bool skip)
 {
 	int flags = block_iter_is_bol(bi) ? 0 : REG_NOTBOL;
 
+	if (m->literal)
+		return literal_search_fwd(&m->lit, bi, skip);
+
 	do {
 		regmatch_t match;
 		struct lineref lr;
@@ -28,7 +222,7 @@ static bool do_search_fwd(regex_t *regex, struct block_iter *bi, bool skip)
 		// partial line (text starting from the cursor position) and
 		// if match.rm_so is 0 then match is at beginning of the text
 		// which is same as the cursor position.
-		if (regexp_exec(regex, lr.line, lr.size, 1, &match, flags)) {
+		if (matcher_exec(m, lr.line, lr.size, 1, &match, flags)) {
 			if (skip && match.rm_so == 0) {
 				// ignore match at current cursor position
 				long count = match.rm_eo;
@@ -38,13 +232,11 @@ static bool do_search_fwd(regex_t *regex, struct block_iter *bi, bool skip)
 					count = 1;
 				}
 				block_iter_skip_bytes(bi, count);
-				return do_search_fwd(regex, bi, false);
+				return do_search_fwd(m, bi, false);
 			}
 
 			block_iter_skip_bytes(bi, match.rm_so);
-			view->cursor = *bi;
-			view->center_on_scroll = true;
-			view_reset_preferred_x(view);
+			found_match(bi);
 			return true;
 		}
 		skip = false; // not at cursor position anymore
@@ -53,7 +245,7 @@ static bool do_search_fwd(regex_t *regex, struct block_iter *bi, bool skip)
 	return false;
 }
 
-static bool do_search_bwd(regex_t *regex, struct block_iter *bi, int cx, bool skip)
+static bool do_search_bwd(const struct matcher *m, struct block_iter *bi, int cx, bool skip)
 {
 	if (block_iter_is_eof(bi))
 		goto next;
@@ -66,7 +258,7 @@ static bool do_search_bwd(regex_t *regex, struct block_iter *bi, int cx, bool sk
 		long pos = 0;
 
 		fill_line_ref(bi, &lr);
-		while (pos <= lr.size && regexp_exec(regex, lr.line + pos, lr.size - pos, 1, &match, flags)) {
+		while (pos <= lr.size && matcher_exec(m, lr.line + pos, lr.size - pos, 1, &match, flags)) {
 			flags = REG_NOTBOL;
 			if (cx >= 0) {
 				if (pos + match.rm_so >= cx) {
@@ -91,9 +283,7 @@ static bool do_search_bwd(regex_t *regex, struct block_iter *bi, int cx, bool sk
 
 		if (offset >= 0) {
 			block_iter_skip_bytes(bi, offset);
-			view->cursor = *bi;
-			view->center_on_scroll = true;
-			view_reset_preferred_x(view);
+			found_match(bi);
 			return true;
 		}
 next:
@@ -105,12 +295,15 @@ next:
 bool search_tag(const char *pattern, bool *err)
 {
 	BLOCK_ITER(bi, &buffer->blocks);
-	regex_t regex;
+	struct matcher m;
 	bool found = false;
 
-	if (!regexp_compile_basic(&regex, pattern, REG_NEWLINE)) {
+	finish_loading(buffer);
+	if (!matcher_compile(&m, pattern, REG_NEWLINE, true)) {
 		*err = true;
-	} else if (do_search_fwd(&regex, &bi, false)) {
+		return false;
+	}
+	if (do_search_fwd(&m, &bi, false)) {
 		view->center_on_scroll = true;
 		found = true;
 	} else {
@@ -119,12 +312,12 @@ bool search_tag(const char *pattern, bool *err)
 		error_msg("Tag not found.");
 		*err = true;
 	}
-	regfree(&regex);
+	matcher_free(&m);
 	return found;
 }
 
 static struct {
-	regex_t regex;
+	struct matcher matcher;
 	char *pattern;
 	enum search_direction direction;
 
@@ -145,7 +338,7 @@ enum search_direction current_search_direction(void)
 static void free_regex(void)
 {
 	if (current_search.re_flags) {
-		regfree(&current_search.regex);
+		matcher_free(&current_search.matcher);
 		current_search.re_flags = 0;
 	}
 }
@@ -183,10 +376,10 @@ static bool update_regex(void)
 	free_regex();
 
 	current_search.re_flags = re_flags;
-	if (regexp_compile(&current_search.regex, current_search.pattern, current_search.re_flags))
+	if (matcher_compile(&current_search.matcher, current_search.pattern, current_search.re_flags, false))
 		return true;
 
-	free_regex();
+	current_search.re_flags = 0;
 	return false;
 }
 
@@ -207,12 +400,13 @@ static void do_search_next(bool skip)
 	}
 	if (!update_regex())
 		return;
+	finish_loading(buffer);
 	if (current_search.direction == SEARCH_FWD) {
-		if (do_search_fwd(&current_search.regex, &bi, true))
+		if (do_search_fwd(&current_search.matcher, &bi, true))
 			return;
 
 		block_iter_bof(&bi);
-		if (do_search_fwd(&current_search.regex, &bi, false)) {
+		if (do_search_fwd(&current_search.matcher, &bi, false)) {
 			info_msg("Continuing at top.");
 		} else {
 			info_msg("Pattern '%s' not found.", current_search.pattern);
@@ -220,11 +414,11 @@ static void do_search_next(bool skip)
 	} else {
 		int cursor_x = block_iter_bol(&bi);
 
-		if (do_search_bwd(&current_search.regex, &bi, cursor_x, skip))
+		if (do_search_bwd(&current_search.matcher, &bi, cursor_x, skip))
 			return;
 
 		block_iter_eof(&bi);
-		if (do_search_bwd(&current_search.regex, &bi, -1, false)) {
+		if (do_search_bwd(&current_search.matcher, &bi, -1, false)) {
 			info_msg("Continuing at bottom.");
 		} else {
 			info_msg("Pattern '%s' not found.", current_search.pattern);
@@ -283,7 +477,7 @@ static void build_replacement(struct gbuf *buf, const char *line, const char *fo
  * "foo abc bar abc baz" "foo abc bar abc baz"
  * "foo x bar abc baz"   " bar abc baz"
  */
-static int replace_on_line(struct lineref *lr, regex_t *re, const char *format,
+static int replace_on_line(struct lineref *lr, const struct matcher *mt, const char *format,
 	struct block_iter *bi, unsigned int *flagsp)
 {
 	unsigned char *buf = (unsigned char *)lr->line;
@@ -293,7 +487,7 @@ static int replace_on_line(struct lineref *lr, regex_t *re, const char *format,
 	int eflags = 0;
 	int nr = 0;
 
-	while (regexp_exec(re, buf + pos, lr->size - pos, MAX_SUBSTRINGS, m, eflags)) {
+	while (matcher_exec(mt, buf + pos, lr->size - pos, MAX_SUBSTRINGS, m, eflags)) {
 		int match_len = m[0].rm_eo - m[0].rm_so;
 		bool skip = false;
 
@@ -366,25 +560,208 @@ out:
 	return nr;
 }
 
+struct replace_edits {
+	struct bulk_edit *ptr;
+	long count;
+	long alloc;
+	// replacement texts of all edits, in order
+	struct gbuf text;
+};
+
+static void add_edit(struct replace_edits *edits, long offset, long del, long ins)
+{
+	struct bulk_edit *e;
+
+	if (edits->count == edits->alloc) {
+		edits->alloc = edits->alloc * 3 / 2 + 64;
+		xrenew(edits->ptr, edits->alloc);
+	}
+	e = &edits->ptr[edits->count++];
+	e->offset = offset;
+	e->del = del;
+	e->ins = ins;
+	e->buf = NULL;
+}
+
+// like replace_on_line() but only collects the edits
+static int collect_on_line(struct lineref *lr, long offset, const struct matcher *mt, const char *format,
+	unsigned int flags, struct replace_edits *edits)
+{
+	const unsigned char *buf = lr->line;
+	regmatch_t m[MAX_SUBSTRINGS];
+	size_t pos = 0;
+	int eflags = 0;
+	int nr = 0;
+
+	while (matcher_exec(mt, buf + pos, lr->size - pos, MAX_SUBSTRINGS, m, eflags)) {
+		long match_len = m[0].rm_eo - m[0].rm_so;
+		long len = edits->text.len;
+
+		build_replacement(&edits->text, buf + pos, format, m);
+		len = edits->text.len - len;
+		if (match_len || len)
+			add_edit(edits, offset + pos + m[0].rm_so, match_len, len);
+		nr++;
+
+		if (!match_len)
+			break;
+
+		if (!(flags & REPLACE_GLOBAL))
+			break;
+
+		pos += m[0].rm_so + match_len;
+
+		/* don't match beginning of line again */
+		eflags = REG_NOTBOL;
+	}
+	return nr;
+}
+
+// like collect_on_line() for every line but searches block data directly
+static int collect_literal(const struct literal *lit, const char *format, struct block_iter *bi,
+	long nr_bytes, unsigned int flags, struct replace_edits *edits, int *nr_lines)
+{
+	struct block *blk = bi->blk;
+	long blk_offset = block_iter_get_offset(bi) - bi->offset;
+	long pos = bi->offset;
+	// newline after last match in blk
+	long eol = -1;
+	int nr = 0;
+
+	while (nr_bytes > 0) {
+		regmatch_t m[MAX_SUBSTRINGS];
+		long size = blk->size - pos;
+		long so, len, next;
+
+		if (size > nr_bytes)
+			size = nr_bytes;
+		so = find_literal(lit, blk->data + pos, size);
+		if (so < 0) {
+			nr_bytes -= size;
+			if (blk->node.next == bi->head)
+				break;
+			blk_offset += blk->size;
+			blk = BLOCK(blk->node.next);
+			pos = 0;
+			eol = -1;
+			continue;
+		}
+
+		so += pos;
+		literal_match(m, MAX_SUBSTRINGS, so, lit->len);
+		len = edits->text.len;
+		build_replacement(&edits->text, blk->data, format, m);
+		add_edit(edits, blk_offset + so, lit->len, edits->text.len - len);
+		nr++;
+
+		if (so > eol) {
+			eol = find_byte(blk->data, so, blk->size, '\n');
+			(*nr_lines)++;
+		}
+		next = so + lit->len;
+		if (!(flags & REPLACE_GLOBAL)) {
+			// last line of the buffer has no newline
+			next = eol < blk->size ? eol + 1 : blk->size;
+		}
+		nr_bytes -= next - pos;
+		pos = next;
+	}
+	return nr;
+}
+
+static int collect_lines(const struct matcher *m, const char *format, struct block_iter *bi,
+	long nr_bytes, unsigned int flags, struct replace_edits *edits, int *nr_lines)
+{
+	long offset = block_iter_get_offset(bi);
+	int nr_substitutions = 0;
+
+	while (1) {
+		long count;
+		struct lineref lr;
+		int nr;
+
+		fill_line_ref(bi, &lr);
+		count = lr.size;
+		if (lr.size > nr_bytes) {
+			// end of selection is not full line
+			lr.size = nr_bytes;
+		}
+
+		nr = collect_on_line(&lr, offset, m, format, flags, edits);
+		if (nr) {
+			nr_substitutions += nr;
+			(*nr_lines)++;
+		}
+		if (count + 1 >= nr_bytes)
+			break;
+		nr_bytes -= count + 1;
+		offset += count + 1;
+
+		BUG_ON(!block_iter_next_line(bi));
+	}
+	return nr_substitutions;
+}
+
+/*
+ * Replace without confirmation. The range is read once, all edits are
+ * applied in one pass over the blocks and recorded as one change.
+ */
+static int replace_all(const struct matcher *m, const char *format, struct block_iter *bi,
+	long nr_bytes, unsigned int flags, int *nr_lines)
+{
+	struct replace_edits edits = { NULL, 0, 0, GBUF_INIT };
+	int nr_substitutions;
+
+	if (m->literal) {
+		nr_substitutions = collect_literal(&m->lit, format, bi, nr_bytes, flags, &edits, nr_lines);
+	} else {
+		nr_substitutions = collect_lines(m, format, bi, nr_bytes, flags, &edits, nr_lines);
+	}
+
+	if (edits.count) {
+		const char *text = (const char *)edits.text.buffer;
+		struct bulk_edit *last = &edits.ptr[edits.count - 1];
+		long delta = 0;
+		long i;
+
+		for (i = 0; i < edits.count; i++) {
+			struct bulk_edit *e = &edits.ptr[i];
+
+			e->buf = text;
+			text += e->ins;
+			delta += e->ins - e->del;
+		}
+		buffer_bulk_replace(edits.ptr, edits.count);
+
+		/* move cursor after the last replaced text */
+		block_iter_goto_offset(&view->cursor, last->offset + last->del + delta);
+
+		/* update selection length */
+		if (view->selection)
+			view->sel_eo += delta;
+	}
+	free(edits.ptr);
+	gbuf_free(&edits.text);
+	return nr_substitutions;
+}
+
 void reg_replace(const char *pattern, const char *format, unsigned int flags)
 {
 	BLOCK_ITER(bi, &buffer->blocks);
-	unsigned int nr_bytes;
+	long nr_bytes;
 	bool swapped = false;
 	int re_flags = REG_NEWLINE;
 	int nr_substitutions = 0;
 	int nr_lines = 0;
-	regex_t re;
+	bool confirm = flags & REPLACE_CONFIRM;
+	struct timeval start;
+	struct matcher m;
 
+	finish_loading(buffer);
 	if (flags & REPLACE_IGNORE_CASE)
 		re_flags |= REG_ICASE;
-	if (flags & REPLACE_BASIC) {
-		if (!regexp_compile_basic(&re, pattern, re_flags))
-			return;
-	} else {
-		if (!regexp_compile(&re, pattern, re_flags))
-			return;
-	}
+	if (!matcher_compile(&m, pattern, re_flags, flags & REPLACE_BASIC))
+		return;
 
 	if (view->selection) {
 		struct selection_info info;
@@ -401,6 +778,12 @@ void reg_replace(const char *pattern, const char *format, unsigned int flags)
 		nr_bytes = block_iter_get_offset(&eof);
 	}
 
+	gettimeofday(&start, NULL);
+	if (!confirm && nr_bytes) {
+		nr_substitutions = replace_all(&m, format, &bi, nr_bytes, flags, &nr_lines);
+		goto out;
+	}
+
 	/* record multiple changes as one chain only when replacing all */
 	if (!(flags & REPLACE_CONFIRM))
 		begin_change_chain();
@@ -418,7 +801,7 @@ void reg_replace(const char *pattern, const char *format, unsigned int flags)
 			lr.size = nr_bytes;
 		}
 
-		nr = replace_on_line(&lr, &re, format, &bi, &flags);
+		nr = replace_on_line(&lr, &m, format, &bi, &flags);
 		if (nr) {
 			nr_substitutions += nr;
 			nr_lines++;
@@ -434,10 +817,20 @@ void reg_replace(const char *pattern, const char *format, unsigned int flags)
 
 	if (!(flags & REPLACE_CONFIRM))
 		end_change_chain();
-
-	regfree(&re);
-
-	if (nr_substitutions) {
+out:
+	matcher_free(&m);
+
+	if (nr_substitutions && !confirm) {
+		struct timeval end;
+		double secs;
+
+		gettimeofday(&end, NULL);
+		secs = end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1e6;
+		if (secs < 1e-6)
+			secs = 1e-6;
+		info_msg("%d substitutions on %d lines (%.0f/s).", nr_substitutions, nr_lines,
+			nr_substitutions / secs);
+	} else if (nr_substitutions) {
 		info_msg("%d substitutions on %d lines.", nr_substitutions, nr_lines);
 	} else if (!(flags & REPLACE_CANCEL)) {
 		info_msg("Pattern '%s' not found.", pattern);
@@ -77,6 +77,7 @@ static struct state *find_or_add_state(const char *name)
 	st->name = xstrdup(name);
 	st->defined = false;
 	st->type = -1;
+	st->index = current_syntax->states.count;
 	ptr_array_add(&current_syntax->states, st);
 	return st;
 }
@@ -278,7 +279,7 @@ static void cmd_list(const char *pf, char **args)
 {
 	const char *name = args[0];
 	struct string_list *list;
-	int i;
+	unsigned int i, size;
 
 	close_state();
 	if (no_syntax())
@@ -296,15 +297,43 @@ static void cmd_list(const char *pf, char **args)
 	list->defined = true;
 	list->icase = !!*pf;
 
+	// at most quarter full so that misses end at an empty slot quickly
+	for (size = 16; size < 4 * count_strings(args + 1); size *= 2)
+		;
+	list->mask = size - 1;
+	list->slots = xnew(struct hash_str, size);
+	for (i = 0; i < size; i++)
+		list->slots[i].len = -1;
+
 	for (i = 1; args[i]; i++) {
 		const char *str = args[i];
 		int len = strlen(str);
-		long idx = buf_hash(str, len) % ARRAY_COUNT(list->hash);
-		struct hash_str *h = xmalloc(sizeof(struct hash_str *) + sizeof(int) + len);
-		h->next = list->hash[idx];
+		unsigned int hash, idx;
+		struct hash_str *h;
+
+		if (list->icase) {
+			hash = buf_hash_icase(str, len);
+		} else {
+			hash = buf_hash(str, len);
+		}
+		for (idx = hash & list->mask; ; idx = (idx + 1) & list->mask) {
+			h = &list->slots[idx];
+			if (h->len < 0)
+				break;
+			if (h->hash == hash && h->len == len && !memcmp(hash_str_ptr(h), str, len))
+				break;
+		}
+		if (h->len >= 0) {
+			// duplicate
+			continue;
+		}
+		h->hash = hash;
 		h->len = len;
-		memcpy(h->str, str, len);
-		list->hash[idx] = h;
+		if (len > HASH_STR_INLINE) {
+			h->str.ptr = xmemdup(str, len);
+		} else {
+			memcpy(h->str.buf, str, len);
+		}
 	}
 }
 
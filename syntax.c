@@ -7,17 +7,6 @@
 
 static PTR_ARRAY(syntaxes);
 
-unsigned int buf_hash(const char *str, unsigned int size)
-{
-	long i, hash = 0;
-
-	for (i = 0; i < size; i++) {
-		unsigned int ch = tolower(str[i]);
-		hash = (hash << 5) - hash + ch;
-	}
-	return hash;
-}
-
 struct string_list *find_string_list(struct syntax *syn, const char *name)
 {
 	int i;
@@ -72,23 +61,22 @@ static const char *fix_name(const char *name, const char *prefix)
 	return buf;
 }
 
-static void fix_action(struct syntax *syn, struct action *a, const char *prefix)
+// copy of subsyntax state with index i is syn->states.ptrs[offset + i]
+static void fix_action(struct syntax *syn, struct action *a, int offset)
 {
-	if (a->destination) {
-		const char *name = fix_name(a->destination->name, prefix);
-		a->destination = find_state(syn, name);
-	}
+	if (a->destination)
+		a->destination = syn->states.ptrs[offset + a->destination->index];
 	if (a->emit_name)
 		a->emit_name = xstrdup(a->emit_name);
 }
 
-static void fix_conditions(struct syntax *syn, struct state *s, struct syntax_merge *m, const char *prefix)
+static void fix_conditions(struct syntax *syn, struct state *s, struct syntax_merge *m, int offset)
 {
 	int i;
 
 	for (i = 0; i < s->conds.count; i++) {
 		struct condition *c = s->conds.ptrs[i];
-		fix_action(syn, &c->a, prefix);
+		fix_action(syn, &c->a, offset);
 		if (c->a.destination == NULL && has_destination(c->type))
 			c->a.destination = m->return_state;
 
@@ -98,7 +86,7 @@ static void fix_conditions(struct syntax *syn, struct state *s, struct syntax_me
 		}
 	}
 
-	fix_action(syn, &s->a, prefix);
+	fix_action(syn, &s->a, offset);
 	if (s->a.destination == NULL)
 		s->a.destination = m->return_state;
 }
@@ -133,6 +121,7 @@ struct state *merge_syntax(struct syntax *syn, struct syntax_merge *m)
 		int j;
 
 		states->ptrs[i] = s;
+		s->index = i;
 		s->name = xstrdup(fix_name(s->name, prefix));
 		s->emit_name = xstrdup(s->emit_name);
 		s->conds.ptrs = xmemdup(s->conds.ptrs, sizeof(void *) * s->conds.alloc);
@@ -147,9 +136,13 @@ struct state *merge_syntax(struct syntax *syn, struct syntax_merge *m)
 	}
 
 	for (i = old_count; i < states->count; i++) {
-		fix_conditions(syn, states->ptrs[i], m, prefix);
-		if (m->delim)
-			update_state_colors(syn, states->ptrs[i]);
+		struct state *s = states->ptrs[i];
+
+		fix_conditions(syn, s, m, old_count);
+		if (m->heredoc) {
+			s->in_heredoc = true;
+			update_state_colors(syn, s);
+		}
 	}
 
 	m->subsyn->used = true;
@@ -192,13 +185,13 @@ static void free_string_list(struct string_list *list)
 {
 	int i;
 
-	for (i = 0; i < ARRAY_COUNT(list->hash); i++) {
-		struct hash_str *h = list->hash[i];
-		while (h) {
-			struct hash_str *next = h->next;
-			free(h);
-			h = next;
+	if (list->slots) {
+		for (i = 0; i <= list->mask; i++) {
+			struct hash_str *h = &list->slots[i];
+			if (h->len > HASH_STR_INLINE)
+				free(h->str.ptr);
 		}
+		free(list->slots);
 	}
 	free(list->name);
 	free(list);
@@ -214,6 +207,47 @@ static void free_syntax(struct syntax *syn)
 	free(syn);
 }
 
+static bool can_match_byte(const struct condition *cond, unsigned int ch)
+{
+	switch (cond->type) {
+	case COND_CHAR:
+	case COND_CHAR_BUFFER:
+		return cond->u.cond_char.bitmap[ch / 8] & 1 << (ch & 7);
+	case COND_STR:
+	case COND_STR2:
+		return cond->u.cond_str.len == 0 || (unsigned char)cond->u.cond_str.str[0] == ch;
+	case COND_STR_ICASE:
+		return cond->u.cond_str.len == 0 || tolower((unsigned char)cond->u.cond_str.str[0]) == tolower(ch);
+	default:
+		return true;
+	}
+}
+
+static void compile_state(struct state *s)
+{
+	unsigned int ch;
+
+	s->nr_stop_bytes = 0;
+	if (s->conds.count > USHRT_MAX) {
+		// leave zeroed, all conditions are tried
+		s->nr_stop_bytes = ARRAY_COUNT(s->stop_bytes) + 1;
+		return;
+	}
+	for (ch = 0; ch < 256; ch++) {
+		int i = 0;
+
+		while (i < s->conds.count && !can_match_byte(s->conds.ptrs[i], ch))
+			i++;
+		s->first_cond[ch] = i;
+
+		if (i == s->conds.count || s->nr_stop_bytes > ARRAY_COUNT(s->stop_bytes))
+			continue;
+		if (s->nr_stop_bytes < ARRAY_COUNT(s->stop_bytes))
+			s->stop_bytes[s->nr_stop_bytes] = ch;
+		s->nr_stop_bytes++;
+	}
+}
+
 void finalize_syntax(struct syntax *syn, int saved_nr_errors)
 {
 	int i;
@@ -245,6 +279,14 @@ void finalize_syntax(struct syntax *syn, int saved_nr_errors)
 		return;
 	}
 
+	for (i = 0; i < syn->states.count; i++) {
+		struct state *s = syn->states.ptrs[i];
+
+		// copies of subsyntax states have the same conditions
+		if (!s->copied)
+			compile_state(s);
+	}
+
 	// unused states and lists cause warning only
 	visit(syn->states.ptrs[0]);
 	for (i = 0; i < syn->states.count; i++) {
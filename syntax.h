@@ -3,6 +3,7 @@
 
 #include "libc.h"
 #include "ptr-array.h"
+#include "ctype.h"
 
 enum condition_type {
 	COND_BUFIS,
@@ -63,15 +64,44 @@ struct heredoc_state {
 	int len;
 };
 
+// interned pointers, open addressing with linear probing, see hl.c
+struct intern_table {
+	// NULL if slot is empty, size is power of two
+	void **slots;
+	unsigned int mask;
+	unsigned int count;
+};
+
+// interned heredoc delimiter, see hl.c
+struct heredoc_delim {
+	char *str;
+	int len;
+	unsigned int hash;
+	// interned struct heredoc_line for each state
+	struct intern_table lines;
+};
+
+// start state of a line inside heredoc
+struct heredoc_line {
+	struct state *state;
+	struct heredoc_delim *delim;
+};
+
 struct state {
 	char *name;
 	char *emit_name;
 	struct ptr_array conds;
 
+	// index in syntax states, see merge_syntax()
+	int index;
+
 	bool defined;
 	bool visited;
 	bool copied;
 
+	// copy of heredoc subsyntax state, delimiter is not part of the state
+	bool in_heredoc;
+
 	enum {
 		STATE_EAT,
 		STATE_NOEAT,
@@ -80,21 +110,44 @@ struct state {
 	} type;
 	struct action a;
 
+	// Index of first condition that can match each byte. Conditions
+	// before it are char conditions or str conditions of length two
+	// which can't match the byte. Set by finalize_syntax().
+	unsigned short first_cond[256];
+
+	// Bytes for which first_cond is less than number of conditions.
+	// If there are more than three nr_stop_bytes is four and the bytes
+	// are not stored.
+	unsigned char nr_stop_bytes;
+	unsigned char stop_bytes[3];
+
 	struct {
 		struct syntax *subsyntax;
+		// subsyntax merged once and shared by all delimiters
+		struct state *shared;
+		// heredocs nested in heredoc, merged once per delimiter
 		struct ptr_array states;
 	} heredoc;
 };
 
+// strings up to this length are stored in the hash table itself
+#define HASH_STR_INLINE 16
+
 struct hash_str {
-	struct hash_str *next;
+	unsigned int hash;
+	// -1 if slot is empty
 	int len;
-	char str[1];
+	union {
+		char buf[HASH_STR_INLINE];
+		char *ptr;
+	} str;
 };
 
+// open addressing with linear probing, size is power of two
 struct string_list {
 	char *name;
-	struct hash_str *hash[62];
+	struct hash_str *slots;
+	unsigned int mask;
 	bool icase;
 	bool used;
 	bool defined;
@@ -105,6 +158,7 @@ struct syntax {
 	struct ptr_array states;
 	struct ptr_array string_lists;
 	struct ptr_array default_colors;
+	struct intern_table heredoc_delims;
 	bool heredoc;
 	bool used;
 };
@@ -112,8 +166,11 @@ struct syntax {
 struct syntax_merge {
 	struct syntax *subsyn;
 	struct state *return_state;
+	// delimiter is copied to heredocend conditions if not NULL
 	const char *delim;
 	int delim_len;
+	// merged while highlighting
+	bool heredoc;
 };
 
 static inline bool is_subsyntax(struct syntax *syn)
@@ -121,7 +178,37 @@ static inline bool is_subsyntax(struct syntax *syn)
 	return syn->name[0] == '.';
 }
 
-unsigned int buf_hash(const char *str, unsigned int size);
+static inline const char *hash_str_ptr(const struct hash_str *h)
+{
+	return h->len <= HASH_STR_INLINE ? h->str.buf : h->str.ptr;
+}
+
+static inline unsigned int mix_hash(unsigned int hash)
+{
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6d;
+	hash ^= hash >> 12;
+	return hash;
+}
+
+static inline unsigned int buf_hash(const char *str, unsigned int size)
+{
+	unsigned int i, hash = size;
+
+	for (i = 0; i < size; i++)
+		hash = hash * 31 + (unsigned char)str[i];
+	return mix_hash(hash);
+}
+
+static inline unsigned int buf_hash_icase(const char *str, unsigned int size)
+{
+	unsigned int i, hash = size;
+
+	for (i = 0; i < size; i++)
+		hash = hash * 31 + (unsigned char)tolower(str[i]);
+	return mix_hash(hash);
+}
+
 struct string_list *find_string_list(struct syntax *syn, const char *name);
 struct state *find_state(struct syntax *syn, const char *name);
 struct state *merge_syntax(struct syntax *syn, struct syntax_merge *m);
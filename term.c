@@ -467,6 +467,23 @@ bool term_read_key(int *key)
 	return ok;
 }
 
+// returns false if no input arrived in timeout milliseconds
+bool term_wait_input(int timeout)
+{
+	struct timeval tv = {
+		.tv_sec = timeout / 1000,
+		.tv_usec = (timeout % 1000) * 1000
+	};
+	fd_set set;
+
+	if (input_buf_fill)
+		return true;
+
+	FD_ZERO(&set);
+	FD_SET(0, &set);
+	return select(1, &set, NULL, NULL, &tv) > 0;
+}
+
 char *term_read_paste(long *size)
 {
 	long alloc = ROUND_UP(input_buf_fill + 1, 1024);
@@ -76,6 +76,7 @@ void term_raw(void);
 void term_cooked(void);
 
 bool term_read_key(int *key);
+bool term_wait_input(int timeout);
 char *term_read_paste(long *size);
 void term_discard_paste(void);
 
@@ -1,9 +1,21 @@
 #include "editor.h"
 #include "common.h"
 #include "path.h"
+#include "newline.h"
+#include "block-tree.h"
+#include "block.h"
+#include "window.h"
+#include "view.h"
+#include "change.h"
+#include "state.h"
+#include "hl.h"
+#include "search.h"
+#include "options.h"
+#include "gbuf.h"
 
 #include <locale.h>
 #include <langinfo.h>
+#include <stdint.h>
 
 static void fail(const char *format, ...)
 {
@@ -39,6 +51,476 @@ static void test_relative_filename(void)
 	}
 }
 
+static void test_nl_kernel(const struct nl_kernels *k, const char *buf, long size)
+{
+	const struct nl_kernels *s = &nl_kernels[0];
+	char *dst = xnew(char, size + 1);
+	long nl = s->count(buf, size);
+	long n;
+
+	if (k->count(buf, size) != nl)
+		fail("%s count(%ld) -> %ld, expected %ld\n", k->name, size, k->count(buf, size), nl);
+
+	memset(dst, 0, size + 1);
+	n = k->copy_count(dst, buf, size);
+	if (n != nl || memcmp(dst, buf, size) || dst[size])
+		fail("%s copy_count(%ld) failed\n", k->name, size);
+
+	for (n = 1; n <= nl + 1; n += n < 40 ? 1 : nl / 50 + 1) {
+		if (k->find_nth(buf, size, n) != s->find_nth(buf, size, n))
+			fail("%s find_nth(%ld, %ld) failed\n", k->name, size, n);
+	}
+	if (nl && k->find_nth(buf, size, nl) != s->find_nth(buf, size, nl))
+		fail("%s find_nth(%ld, %ld) failed\n", k->name, size, nl);
+	for (n = -1; n <= 0; n++) {
+		if (k->find_nth(buf, size, n))
+			fail("%s find_nth(%ld, %ld) did not return NULL\n", k->name, size, n);
+	}
+	free(dst);
+}
+
+static void test_nl_kernels(void)
+{
+	static const int sizes[] = { 0, 1, 15, 16, 17, 31, 32, 33, 64, 100, 511, 4096, 255 * 32 + 7, 20000 };
+	long max = 20000 + 64;
+	char *buf = xnew(char, max);
+	const struct nl_kernels *k;
+	int i, align;
+
+	for (k = nl_kernels + 1; k->name; k++) {
+		if (!k->supported())
+			continue;
+
+		// newline density from some to all to none to one
+		for (i = 0; i < ARRAY_COUNT(sizes); i++) {
+			for (align = 0; align < 4; align++) {
+				long j;
+
+				for (j = 0; j < max; j++)
+					buf[j] = j % 3 ? 'x' : '\n';
+				test_nl_kernel(k, buf + align, sizes[i]);
+				memset(buf, '\n', max);
+				test_nl_kernel(k, buf + align, sizes[i]);
+				memset(buf, 'x', max);
+				test_nl_kernel(k, buf + align, sizes[i]);
+				buf[sizes[i] / 2 + align] = '\n';
+				test_nl_kernel(k, buf + align, sizes[i]);
+			}
+		}
+		for (i = 0; i < max; i++)
+			buf[i] = rand() % 40 ? rand() : '\n';
+		for (i = 0; i < 200; i++)
+			test_nl_kernel(k, buf + rand() % 64, rand() % 20000);
+	}
+	free(buf);
+}
+
+static struct block *nth_block(struct list_head *head, long n)
+{
+	struct block *blk;
+
+	list_for_each_entry(blk, head, node) {
+		if (!n--)
+			return blk;
+	}
+	return NULL;
+}
+
+static struct block *new_test_block(void)
+{
+	struct block *blk = xnew0(struct block, 1);
+
+	blk->size = 1 + rand() % 100;
+	blk->nl = rand() % (blk->size + 1);
+	return blk;
+}
+
+static void check_block_tree(struct list_head *head)
+{
+	long size = 0, nl = 0;
+	struct block *blk;
+	int i;
+
+	block_tree_check(head);
+	list_for_each_entry(blk, head, node) {
+		size += blk->size;
+		nl += blk->nl;
+	}
+	for (i = 0; i < 10; i++) {
+		long offset = rand() % (size + 2);
+		long line = rand() % (nl + 2);
+		long pos = offset, skip = line;
+		struct block *expected = NULL;
+		struct block *found;
+
+		// linear walk
+		list_for_each_entry(blk, head, node) {
+			if (pos <= blk->size) {
+				expected = blk;
+				break;
+			}
+			pos -= blk->size;
+		}
+		found = block_find_offset(head, &offset);
+		if (found != expected || (found && offset != pos))
+			fail("block_find_offset() failed, %ld bytes\n", size);
+
+		list_for_each_entry(blk, head, node) {
+			if (skip <= blk->nl || blk->node.next == head)
+				break;
+			skip -= blk->nl;
+		}
+		found = block_find_line(head, &line);
+		if (found != blk || line != skip)
+			fail("block_find_line() failed, %ld lines\n", nl);
+	}
+}
+
+// random inserts, deletes, splits and merges
+static void test_block_tree(void)
+{
+	struct list_head head;
+	struct block *blk, *next;
+	long count = 1;
+	int i;
+
+	list_init(&head);
+	block_append(new_test_block(), &head);
+	for (i = 0; i < 20000; i++) {
+		blk = nth_block(&head, rand() % count);
+		next = blk->node.next == &head ? NULL : BLOCK(blk->node.next);
+
+		switch (rand() % 4) {
+		case 0:
+			if (rand() % 2) {
+				block_insert_before(new_test_block(), blk);
+			} else {
+				block_append(new_test_block(), &head);
+			}
+			count++;
+			break;
+		case 1:
+			if (count == 1)
+				break;
+			block_remove(blk);
+			free(blk);
+			count--;
+			break;
+		case 2:
+			// split
+			if (blk->size < 2)
+				break;
+			next = new_test_block();
+			next->size = rand() % (blk->size - 1) + 1;
+			next->nl = rand() % (next->size + 1);
+			blk->size -= next->size;
+			blk->nl = rand() % (blk->size + 1);
+			block_counts_changed(blk);
+			if (blk->node.next == &head) {
+				block_append(next, &head);
+			} else {
+				block_insert_before(next, BLOCK(blk->node.next));
+			}
+			count++;
+			break;
+		case 3:
+			// merge with next
+			if (!next)
+				break;
+			block_remove(next);
+			blk->size += next->size;
+			blk->nl += next->nl;
+			block_counts_changed(blk);
+			free(next);
+			count--;
+			break;
+		}
+		check_block_tree(&head);
+	}
+	while (count--) {
+		blk = BLOCK(head.next);
+		block_remove(blk);
+		free(blk);
+	}
+}
+
+static void random_edit(struct buffer *b)
+{
+	static const char * const snippets[] = {
+		"x", " ", "\n", "\"", "'", "/*", "*/", "//", "/* c */\n", "#if 0\n", "#endif\n",
+	};
+	long size = block_tree_size(&b->blocks);
+	long offset = rand() % (size + 1);
+
+	block_iter_goto_offset(&view->cursor, offset);
+	begin_change(CHANGE_MERGE_NONE);
+	if (rand() % 3 == 0 && offset < size) {
+		long len = 1 + rand() % (rand() % 10 ? 3 : 2000);
+
+		if (len > size - offset)
+			len = size - offset;
+		buffer_delete_bytes(len);
+	} else if (rand() % 20 == 0) {
+		// long enough to split blocks, comments started by the
+		// snippets continue over many blocks
+		long len = rand() % 10000;
+		char *buf = xnew(char, len);
+		long i;
+
+		for (i = 0; i < len; i++)
+			buf[i] = "ab \n;{}"[rand() % 7];
+		buffer_insert_bytes(buf, len);
+		free(buf);
+	} else {
+		const char *str = snippets[rand() % ARRAY_COUNT(snippets)];
+		buffer_insert_bytes(str, strlen(str));
+	}
+	end_change();
+}
+
+// valid checkpoints of blocks before the block containing line
+static void get_checkpoints(struct buffer *b, int line, struct ptr_array *checkpoints)
+{
+	struct block *blk;
+	long start = 0;
+
+	checkpoints->count = 0;
+	list_for_each_entry(blk, &b->blocks, node) {
+		if (start > line)
+			break;
+		if (start >= b->hl_valid || ((uintptr_t)blk->hl_start & 1))
+			ptr_array_add(checkpoints, NULL);
+		else
+			ptr_array_add(checkpoints, blk->hl_start);
+		start += blk->nl;
+	}
+}
+
+// start states kept up to date across edits must equal freshly computed ones
+static void test_hl_start_states(void)
+{
+	PTR_ARRAY(checkpoints);
+	PTR_ARRAY(fresh);
+	struct state **states = NULL;
+	struct syntax *syn;
+	struct buffer *b;
+	int err, i;
+
+	syn = load_syntax_file("share/syntax/c", true, &err);
+	if (!syn) {
+		fail("share/syntax/c not found, run test in the source directory\n");
+		return;
+	}
+	b = open_empty_buffer();
+	view = window_add_buffer(window, b);
+	buffer = b;
+	b->syn = syn;
+	hl_reset(b);
+
+	for (i = 0; i < 100; i++)
+		random_edit(b);
+	for (i = 0; i < 2000; i++) {
+		int line, first, j;
+
+		random_edit(b);
+		if (rand() % 10 == 0)
+			compact_blocks(b, 1 + rand() % 100);
+		line = rand() % (b->nl + 1);
+		while (!hl_fill_start_states(b, line, rand() % 2 ? 1 + rand() % 300 : 0))
+			;
+		if (i % 10)
+			continue;
+
+		first = b->hl_first;
+		xrenew(states, line - first + 1);
+		memcpy(states, b->line_start_states.ptrs, (line - first + 1) * sizeof(*states));
+		get_checkpoints(b, line, &checkpoints);
+
+		hl_reset(b);
+		hl_fill_start_states(b, line, 0);
+		for (j = first > b->hl_first ? first : b->hl_first; j <= line; j++) {
+			if (b->line_start_states.ptrs[j - b->hl_first] != states[j - first]) {
+				fail("start state of line %d differs after %d edits\n", j, i);
+				break;
+			}
+		}
+		get_checkpoints(b, line, &fresh);
+		for (j = 0; j < checkpoints.count && j < fresh.count; j++) {
+			if (checkpoints.ptrs[j] && fresh.ptrs[j] && checkpoints.ptrs[j] != fresh.ptrs[j]) {
+				fail("checkpoint of block %d differs after %d edits\n", j, i);
+				break;
+			}
+		}
+	}
+	free(checkpoints.ptrs);
+	free(fresh.ptrs);
+	free(states);
+	remove_view(view);
+}
+
+// offsets of all matches, until search wraps around
+static void get_matches(enum search_direction dir, struct ptr_array *matches, long *boundary)
+{
+	long last = -1;
+
+	matches->count = 0;
+	search_set_direction(dir);
+	block_iter_bof(&view->cursor);
+	while (1) {
+		struct block_iter bi;
+		long offset;
+
+		search_next();
+		offset = block_iter_get_offset(&view->cursor);
+		// no pattern matches "-\n" at the beginning
+		if (offset == 0)
+			break;
+		if (last >= 0 && (dir == SEARCH_FWD ? offset <= last : offset >= last))
+			break;
+		ptr_array_add(matches, (void *)offset);
+		last = offset;
+
+		bi = view->cursor;
+		block_iter_normalize(&bi);
+		if (bi.offset == 0 && bi.blk != BLOCK(buffer->blocks.next))
+			(*boundary)++;
+	}
+}
+
+static void compare_matches(const char *pattern, const char *regex, bool icase, long *boundary)
+{
+	static const enum search_direction dirs[] = { SEARCH_FWD, SEARCH_BWD };
+	PTR_ARRAY(a);
+	PTR_ARRAY(b);
+	int i, j;
+
+	options.case_sensitive_search = icase ? CSS_FALSE : CSS_TRUE;
+	for (i = 0; i < ARRAY_COUNT(dirs); i++) {
+		search_set_regexp(pattern);
+		get_matches(dirs[i], &a, boundary);
+		search_set_regexp(regex);
+		get_matches(dirs[i], &b, boundary);
+
+		if (a.count == 0)
+			fail("'%s' not found\n", pattern);
+		if (a.count != b.count)
+			fail("'%s' found %ld times, '%s' %ld times\n", pattern, a.count, regex, b.count);
+		for (j = 0; j < a.count && j < b.count; j++) {
+			if (a.ptrs[j] != b.ptrs[j]) {
+				fail("'%s' found at %ld, '%s' at %ld\n", pattern,
+					(long)a.ptrs[j], regex, (long)b.ptrs[j]);
+				break;
+			}
+		}
+	}
+	free(a.ptrs);
+	free(b.ptrs);
+}
+
+// buffer after replacing pattern, the replacement is undone
+static char *replace_text(const char *pattern, unsigned int flags, long *size)
+{
+	struct block_iter bi, eof;
+	long old_size;
+	char *text;
+
+	eof.head = &buffer->blocks;
+	block_iter_eof(&eof);
+	old_size = block_iter_get_offset(&eof);
+	reg_replace(pattern, "<&>", flags);
+
+	// blocks were replaced
+	bi.head = &buffer->blocks;
+	block_iter_bof(&bi);
+	eof = bi;
+	block_iter_eof(&eof);
+	*size = block_iter_get_offset(&eof);
+	text = block_iter_get_bytes(&bi, *size);
+	if (*size != old_size)
+		undo();
+	return text;
+}
+
+static void compare_replace(const char *pattern, const char *regex, bool icase)
+{
+	static const unsigned int flags[] = { 0, REPLACE_GLOBAL };
+	int i;
+
+	for (i = 0; i < ARRAY_COUNT(flags); i++) {
+		unsigned int f = flags[i] | (icase ? REPLACE_IGNORE_CASE : 0);
+		long a_size, b_size;
+		char *a = replace_text(pattern, f, &a_size);
+		char *b = replace_text(regex, f, &b_size);
+
+		if (a_size != b_size || memcmp(a, b, a_size))
+			fail("replacing '%s' and '%s' differ, flags %u\n", pattern, regex, f);
+		free(a);
+		free(b);
+	}
+}
+
+// pattern without special characters is searched without regexec()
+static void test_literal_search(void)
+{
+	static const char * const words[] = {
+		"foo", "FOO", "Foo", "fOo", "x", "a", ";", " ", "\xc3\xa4", "\xc3\x84",
+	};
+	static const struct {
+		const char *pattern;
+		bool icase;
+	} tests[] = {
+		{ "foo", false },
+		{ "foo", true },
+		{ "Foo", false },
+		{ "fOo", true },
+		// byte searched with memchr() is first or last
+		{ ";foo", false },
+		{ "foo;", false },
+		{ "foo;", true },
+		{ "x f", false },
+		{ "\xc3\xa4", false },
+		{ "\xc3\xa4", true },
+		{ "a\xc3\x84", false },
+		{ "\xc3\x84" "a", true },
+	};
+	enum case_sensitive_search css = options.case_sensitive_search;
+	struct buffer *b = open_empty_buffer();
+	GBUF(text);
+	long boundary = 0;
+	int i;
+
+	view = window_add_buffer(window, b);
+	buffer = b;
+
+	// short lines, many blocks
+	gbuf_add_str(&text, "-\n");
+	while (text.len < 50000) {
+		gbuf_add_str(&text, words[rand() % ARRAY_COUNT(words)]);
+		if (rand() % 3 == 0)
+			gbuf_add_byte(&text, '\n');
+	}
+	// many matches on last line
+	gbuf_add_str(&text, "\nfoo;foo fOo;\xc3\xa4\xc3\x84" "a x foo;\xc3\x84" "a\xc3\xa4");
+	begin_change(CHANGE_MERGE_NONE);
+	buffer_insert_bytes(text.buffer, text.len);
+	end_change();
+	gbuf_free(&text);
+
+	for (i = 0; i < ARRAY_COUNT(tests); i++) {
+		char regex[64];
+
+		// same pattern, but searched with regexec()
+		snprintf(regex, sizeof(regex), "(%s)", tests[i].pattern);
+		compare_matches(tests[i].pattern, regex, tests[i].icase, &boundary);
+		compare_replace(tests[i].pattern, regex, tests[i].icase);
+	}
+	if (boundary == 0)
+		fail("no match at beginning of a block\n");
+
+	options.case_sensitive_search = css;
+	remove_view(view);
+}
+
 int main(int argc, char *argv[])
 {
 	const char *home = getenv("HOME");
@@ -51,7 +533,14 @@ int main(int argc, char *argv[])
 	charset = nl_langinfo(CODESET);
 	if (streq(charset, "UTF-8"))
 		term_utf8 = true;
+	init_nl_kernels();
 
 	test_relative_filename();
+	test_nl_kernels();
+	test_block_tree();
+
+	window = new_window();
+	test_hl_start_states();
+	test_literal_search();
 	return 0;
 }
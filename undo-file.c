@@ -0,0 +1,483 @@
+#include "undo-file.h"
+#include "buffer.h"
+#include "change.h"
+#include "editor.h"
+#include "error.h"
+#include "load-save.h"
+
+#include <sys/mman.h>
+
+/*
+ * Undo history of a file is saved to ~/.dex/undo-<hash of filename> when
+ * the buffer is closed without unsaved changes. The history is valid as
+ * long as size and hash of contents of the file do not change.
+ *
+ * When the file is opened again the history is memory mapped and the
+ * contents of the file are hashed as they are loaded, so that a lazily
+ * loaded file can be edited before the rest of it has been read. The
+ * change tree is built only when undo or redo goes past the changes of
+ * the current session. Deleted bytes of the changes are copied from the
+ * mapping when undo or redo reaches them.
+ *
+ * Files not used for UNDO_FILE_MAX_AGE days are removed, and the oldest
+ * ones when all of them take more than UNDO_FILES_MAX_SIZE bytes.
+ */
+
+#define UNDO_FILE_MAGIC "DEXUNDO1"
+#define UNDO_FILE_MAX_AGE 90
+#define UNDO_FILES_MAX_SIZE (256L << 20)
+
+struct undo_file_header {
+	char magic[8];
+	unsigned long long hash;
+	long long file_size;
+	long long nr_changes;
+	// index of current change
+	long long cur;
+	// filename follows the header, padded to multiple of 8 bytes
+	long long path_len;
+};
+
+// changes are in preorder, first one is change_head
+struct undo_file_change {
+	long long offset;
+	long long del_count;
+	long long ins_count;
+	// offset of deleted bytes in the file
+	long long payload;
+	unsigned int nr_prev;
+	unsigned int move_after;
+};
+
+static char *undo_filename(const char *filename)
+{
+	unsigned long long hash = fnv1a(FNV1A_INIT, filename, strlen(filename));
+	char name[64];
+
+	snprintf(name, sizeof(name), "undo-%016llx", hash);
+	return editor_file(name);
+}
+
+static unsigned long long content_hash(struct buffer *b)
+{
+	unsigned long long hash = FNV1A_INIT;
+	struct block *blk;
+
+	list_for_each_entry(blk, &b->blocks, node)
+		hash = fnv1a(hash, blk->data, blk->size);
+	return hash;
+}
+
+static long table_offset(const struct undo_file_header *h)
+{
+	return ROUND_UP(sizeof(*h) + h->path_len, 8);
+}
+
+static bool history_enabled(struct buffer *b)
+{
+	return options.persistent_undo && b->abs_filename && b->st.st_mode;
+}
+
+void load_undo_history(struct buffer *b)
+{
+	const struct undo_file_header *h;
+	char *filename;
+	struct stat st;
+	void *map;
+	long len;
+	int fd;
+
+	if (!history_enabled(b))
+		return;
+
+	filename = undo_filename(b->abs_filename);
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		goto out;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h)) {
+		close(fd);
+		goto out;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		goto out;
+
+	h = map;
+	len = strlen(b->abs_filename);
+	if (memcmp(h->magic, UNDO_FILE_MAGIC, 8) || h->file_size != b->st.st_size || h->path_len != len)
+		goto unmap;
+	if (table_offset(h) > st.st_size || memcmp(h + 1, b->abs_filename, len))
+		goto unmap;
+	if (h->nr_changes < 1 || h->cur < 0 || h->cur >= h->nr_changes)
+		goto unmap;
+	if (h->nr_changes > (st.st_size - table_offset(h)) / (long)sizeof(struct undo_file_change))
+		goto unmap;
+
+	b->undo_map = map;
+	b->undo_map_size = st.st_size;
+	b->undo_pending = true;
+	b->undo_hash = FNV1A_INIT;
+	hash_loaded_blocks(b, b->blocks.next);
+
+	// used, see prune_undo_files()
+	utimes(filename, NULL);
+	goto out;
+unmap:
+	munmap(map, st.st_size);
+out:
+	free(filename);
+}
+
+/*
+ * Blocks from item to the end of the buffer were just loaded and have
+ * not been edited yet. The history is dropped if the file does not match
+ * it when loading finishes.
+ */
+void hash_loaded_blocks(struct buffer *b, struct list_head *item)
+{
+	const struct undo_file_header *h = (const void *)b->undo_map;
+
+	if (!b->undo_pending)
+		return;
+	for (; item != &b->blocks; item = item->next) {
+		struct block *blk = BLOCK(item);
+
+		b->undo_hash = fnv1a(b->undo_hash, blk->data, blk->size);
+	}
+	if (!buffer_loading(b) && b->undo_hash != h->hash)
+		free_undo_history(b);
+}
+
+/*
+ * Contents of a file whose lines were skipped by load_line() are hashed
+ * from the mapping of the file in order, as far as the first uncounted
+ * block. The blocks before it may have been edited already.
+ */
+void hash_skipped(struct buffer *b)
+{
+	const struct undo_file_header *h = (const void *)b->undo_map;
+	size_t end = b->map_size;
+
+	if (!b->undo_pending)
+		return;
+	if (b->uncounted.count) {
+		struct block *blk = b->uncounted.ptrs[0];
+
+		end = blk->data - b->map;
+	}
+	b->undo_hash = fnv1a(b->undo_hash, b->map + b->undo_hashed, end - b->undo_hashed);
+	b->undo_hashed = end;
+	if (b->uncounted.count)
+		return;
+
+	// see add_missing_newline()
+	if (b->map[b->map_size - 1] != '\n')
+		b->undo_hash = fnv1a(b->undo_hash, "\n", 1);
+	if (b->undo_hash != h->hash)
+		free_undo_history(b);
+}
+
+/*
+ * Changes made before the tree is built are moved under the change which
+ * was current when the history was saved.
+ */
+static void build_change_tree(struct buffer *b)
+{
+	const struct undo_file_header *h = (const void *)b->undo_map;
+	const struct undo_file_change *rec = (const void *)(b->undo_map + table_offset(h));
+	long data_start = table_offset(h) + h->nr_changes * sizeof(*rec);
+	long n = h->nr_changes;
+	struct change *head = &b->change_head;
+	struct change **live = head->prev;
+	unsigned int nr_live = head->nr_prev;
+	struct change **nodes = xnew(struct change *, n);
+	// indices of changes whose children are being decoded
+	long *parents = xnew(long, n);
+	long depth = 0;
+	struct change *cur;
+	long i;
+
+	b->undo_pending = false;
+	head->prev = NULL;
+	head->nr_prev = 0;
+
+	for (i = 0; i < n; i++) {
+		const struct undo_file_change *r = &rec[i];
+		struct change *change = head;
+
+		if (r->del_count < 0 || r->ins_count < 0 || r->offset < 0 || r->nr_prev >= n - i)
+			break;
+		if (r->del_count && (r->payload < data_start || r->payload > (long)b->undo_map_size - r->del_count))
+			break;
+		if (i) {
+			struct change *parent;
+
+			while (depth && nodes[parents[depth - 1]]->nr_prev == rec[parents[depth - 1]].nr_prev)
+				depth--;
+			if (!depth)
+				break;
+			parent = nodes[parents[depth - 1]];
+			change = xnew0(struct change, 1);
+			change->next = parent;
+			change->offset = r->offset;
+			change->del_count = r->del_count;
+			change->ins_count = r->ins_count;
+			change->move_after = r->move_after;
+			change->persisted = r->del_count > 0;
+			change->spill_offset = r->payload;
+			parent->prev[parent->nr_prev++] = change;
+		} else if (r->del_count || r->ins_count) {
+			break;
+		}
+		nodes[i] = change;
+		if (r->nr_prev) {
+			change->prev = xnew(struct change *, r->nr_prev);
+			parents[depth++] = i;
+		}
+	}
+	while (depth && nodes[parents[depth - 1]]->nr_prev == rec[parents[depth - 1]].nr_prev)
+		depth--;
+
+	if (i < n || depth) {
+		long k;
+
+		error_msg("Undo history of %s is corrupted.", b->abs_filename);
+		for (k = 1; k < i; k++) {
+			free(nodes[k]->prev);
+			free(nodes[k]);
+		}
+		free(head->prev);
+		head->prev = live;
+		head->nr_prev = nr_live;
+		goto out;
+	}
+
+	cur = nodes[h->cur];
+	if (nr_live) {
+		unsigned int k;
+
+		xrenew(cur->prev, cur->nr_prev + nr_live);
+		for (k = 0; k < nr_live; k++) {
+			live[k]->next = cur;
+			cur->prev[cur->nr_prev++] = live[k];
+		}
+		free(live);
+	}
+	if (b->cur_change == head)
+		b->cur_change = cur;
+	if (b->saved_change == head)
+		b->saved_change = cur;
+out:
+	free(parents);
+	free(nodes);
+}
+
+void decode_undo_history(struct buffer *b)
+{
+	// the history is checked when the whole file has been hashed
+	finish_loading(b);
+	if (b->undo_pending)
+		build_change_tree(b);
+}
+
+static bool write_history(int fd, struct buffer *b, struct ptr_array *changes, long cur)
+{
+	struct undo_file_header h;
+	struct undo_file_change *table;
+	long len = strlen(b->abs_filename);
+	long data_start, payload, i;
+	bool ok = false;
+	char *pad;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, UNDO_FILE_MAGIC, 8);
+	h.hash = content_hash(b);
+	h.file_size = b->st.st_size;
+	h.nr_changes = changes->count;
+	h.cur = cur;
+	h.path_len = len;
+
+	data_start = table_offset(&h) + changes->count * sizeof(*table);
+	payload = data_start;
+	table = xnew0(struct undo_file_change, changes->count);
+	for (i = 0; i < changes->count; i++) {
+		const struct change *change = changes->ptrs[i];
+		struct undo_file_change *r = &table[i];
+
+		r->offset = change->offset;
+		r->del_count = change->del_count;
+		r->ins_count = change->ins_count;
+		r->nr_prev = change->nr_prev;
+		r->move_after = change->move_after;
+		if (change->del_count) {
+			r->payload = payload;
+			payload += change->del_count;
+		}
+	}
+
+	pad = xnew0(char, table_offset(&h) - sizeof(h) - len + 1);
+	if (xwrite(fd, &h, sizeof(h)) < 0 ||
+	    xwrite(fd, b->abs_filename, len) < 0 ||
+	    xwrite(fd, pad, table_offset(&h) - sizeof(h) - len) < 0 ||
+	    xwrite(fd, table, changes->count * sizeof(*table)) < 0)
+		goto out;
+
+	for (i = 0; i < changes->count; i++) {
+		const struct change *change = changes->ptrs[i];
+		char *buf;
+		long rc;
+
+		if (!change->del_count)
+			continue;
+		if (change->buf) {
+			rc = xwrite(fd, change->buf, change->del_count);
+		} else {
+			buf = read_change_payload(b, change);
+			if (!buf)
+				goto out;
+			rc = xwrite(fd, buf, change->del_count);
+			free(buf);
+		}
+		if (rc < 0)
+			goto out;
+	}
+	ok = true;
+out:
+	free(pad);
+	free(table);
+	return ok;
+}
+
+struct undo_file {
+	char *filename;
+	time_t mtime;
+	long size;
+};
+
+static int undo_file_cmp(const void *ap, const void *bp)
+{
+	const struct undo_file *a = *(const struct undo_file **)ap;
+	const struct undo_file *b = *(const struct undo_file **)bp;
+
+	// newest first
+	if (a->mtime != b->mtime)
+		return a->mtime < b->mtime ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Undo histories contain deleted text and there is one for every file
+ * ever edited. Remove old ones and the oldest ones when they take too
+ * much space.
+ */
+static void prune_undo_files(void)
+{
+	char *dirname = editor_file("");
+	time_t now = time(NULL);
+	PTR_ARRAY(files);
+	struct dirent *de;
+	long total = 0;
+	long i;
+	DIR *dir;
+
+	dir = opendir(dirname);
+	free(dirname);
+	if (!dir)
+		return;
+	while ((de = readdir(dir))) {
+		struct undo_file *f;
+		struct stat st;
+		char *filename;
+
+		if (!str_has_prefix(de->d_name, "undo-"))
+			continue;
+		filename = editor_file(de->d_name);
+		if (stat(filename, &st) || !S_ISREG(st.st_mode)) {
+			free(filename);
+			continue;
+		}
+		if (now - st.st_mtime > UNDO_FILE_MAX_AGE * 24 * 60 * 60) {
+			unlink(filename);
+			free(filename);
+			continue;
+		}
+		f = xnew(struct undo_file, 1);
+		f->filename = filename;
+		f->mtime = st.st_mtime;
+		f->size = st.st_size;
+		ptr_array_add(&files, f);
+	}
+	closedir(dir);
+
+	qsort(files.ptrs, files.count, sizeof(*files.ptrs), undo_file_cmp);
+	for (i = 0; i < files.count; i++) {
+		struct undo_file *f = files.ptrs[i];
+
+		total += f->size;
+		if (total > UNDO_FILES_MAX_SIZE)
+			unlink(f->filename);
+		free(f->filename);
+	}
+	ptr_array_free(&files);
+}
+
+// called when buffer is closed
+void save_undo_history(struct buffer *b)
+{
+	PTR_ARRAY(stack);
+	PTR_ARRAY(changes);
+	char *filename, *tmp;
+	long cur = 0;
+	int fd;
+
+	// a mapped history which has not been used is still valid
+	if (!history_enabled(b) || buffer_modified(b) || !b->change_head.nr_prev)
+		return;
+	if (b->undo_pending)
+		decode_undo_history(b);
+	finish_loading(b);
+
+	// preorder
+	ptr_array_add(&stack, &b->change_head);
+	while (stack.count) {
+		struct change *change = ptr_array_remove_idx(&stack, stack.count - 1);
+		unsigned int i;
+
+		if (change == b->cur_change)
+			cur = changes.count;
+		ptr_array_add(&changes, change);
+		for (i = change->nr_prev; i > 0; i--)
+			ptr_array_add(&stack, change->prev[i - 1]);
+	}
+	free(stack.ptrs);
+
+	filename = undo_filename(b->abs_filename);
+	tmp = xsprintf("%s.tmp", filename);
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd < 0) {
+		error_msg("Error creating %s: %s", tmp, strerror(errno));
+	} else {
+		bool ok = write_history(fd, b, &changes, cur);
+
+		if (close(fd))
+			ok = false;
+		if (!ok || rename(tmp, filename)) {
+			error_msg("Error saving undo history: %s", strerror(errno));
+			unlink(tmp);
+		}
+		prune_undo_files();
+	}
+	free(changes.ptrs);
+	free(filename);
+	free(tmp);
+}
+
+void free_undo_history(struct buffer *b)
+{
+	if (b->undo_map) {
+		munmap(b->undo_map, b->undo_map_size);
+		b->undo_map = NULL;
+	}
+	b->undo_pending = false;
+}
@@ -0,0 +1,14 @@
+#ifndef UNDO_FILE_H
+#define UNDO_FILE_H
+
+struct buffer;
+struct list_head;
+
+void load_undo_history(struct buffer *b);
+void hash_loaded_blocks(struct buffer *b, struct list_head *item);
+void hash_skipped(struct buffer *b);
+void decode_undo_history(struct buffer *b);
+void save_undo_history(struct buffer *b);
+void free_undo_history(struct buffer *b);
+
+#endif
@@ -1,37 +1,140 @@
 #include "view.h"
+#include "block-tree.h"
+#include "newline.h"
 #include "window.h"
 #include "uchar.h"
 
 struct view *view;
 
-void view_update_cursor_y(struct view *v)
+static void check_cursor_pos(struct view *v)
 {
-	struct buffer *b = v->buffer;
 	struct block *blk;
-	unsigned int nl = 0;
+	long offset = 0;
+	long nl = 0;
 
-	list_for_each_entry(blk, &b->blocks, node) {
-		if (blk == v->cursor.blk) {
-			nl += count_nl(blk->data, v->cursor.offset);
-			v->cy = nl;
-			return;
-		}
+	list_for_each_entry(blk, &v->buffer->blocks, node) {
+		if (blk == v->cursor.blk)
+			break;
+		offset += blk->size;
 		nl += blk->nl;
 	}
-	BUG_ON(1);
+	BUG_ON(blk != v->cursor.blk);
+	BUG_ON(v->pos_blk_offset != offset);
+	BUG_ON(v->pos_blk_line != nl);
+	BUG_ON(!blk->uncounted && v->pos_line != count_nl(blk->data, v->cursor.offset));
 }
 
-void view_update_cursor_x(struct view *v)
+/*
+ * Update cached cursor position. Moving the cursor inside a block costs
+ * counting newlines between the old and new offset. Moving to a
+ * neighbour block is O(1), anything else is a block tree lookup.
+ *
+ * The cache stays valid as long as contents of the buffer does not change.
+ * Functions in block.c call view_cursor_edited() after each modification.
+ */
+static void view_update_cursor_pos(struct view *v)
 {
-	unsigned int tw = v->buffer->options.tab_width;
-	long idx = 0;
-	struct lineref lr;
-	int c = 0;
-	int w = 0;
+	struct block *blk = v->cursor.blk;
+	long offset = v->cursor.offset;
 
-	v->cx = fetch_this_line(&v->cursor, &lr);
-	while (idx < v->cx) {
-		unsigned int u = lr.line[idx++];
+	if (blk != v->pos_blk) {
+		struct block *old = v->pos_blk;
+
+		if (old && blk->node.prev == &old->node) {
+			v->pos_blk_offset += old->size;
+			v->pos_blk_line += old->nl;
+		} else if (old && blk->node.next == &old->node) {
+			v->pos_blk_offset -= blk->size;
+			v->pos_blk_line -= blk->nl;
+		} else {
+			v->pos_blk_offset = block_start_offset(blk);
+			v->pos_blk_line = block_start_line(blk);
+		}
+		v->pos_blk = blk;
+		v->pos_offset = 0;
+		v->pos_line = 0;
+	}
+	if (blk->uncounted) {
+		// counted after the command, see main_loop()
+		v->pos_line = (double)blk->nl * offset / blk->size;
+	} else if (offset > v->pos_offset) {
+		v->pos_line += count_nl(blk->data + v->pos_offset, offset - v->pos_offset);
+	} else if (offset < v->pos_offset) {
+		v->pos_line -= count_nl(blk->data + offset, v->pos_offset - offset);
+	}
+	v->pos_offset = offset;
+
+	if (DEBUG > 2)
+		check_cursor_pos(v);
+}
+
+void view_update_cursor_y(struct view *v)
+{
+	view_update_cursor_pos(v);
+	v->cy = v->pos_blk_line + v->pos_line;
+}
+
+long view_get_cursor_offset(struct view *v)
+{
+	view_update_cursor_pos(v);
+	return v->pos_blk_offset + v->pos_offset;
+}
+
+// checkpoints after offset are invalid
+static void view_columns_edited(struct view *v, long offset)
+{
+	if (offset < v->col_bol) {
+		v->col_count = 0;
+		return;
+	}
+	while (v->col_count && v->col_bol + v->col_ptr[v->col_count - 1].idx > offset)
+		v->col_count--;
+}
+
+/*
+ * Buffer has been modified at cursor of v. Absolute position of the
+ * cursor did not change but the cursor may have moved to another block.
+ * Cache must have been updated before the modification.
+ */
+void view_cursor_edited(struct view *v)
+{
+	struct buffer *b = v->buffer;
+	struct block *blk = v->cursor.blk;
+	long offset = v->cursor.offset;
+	long edit_offset = v->pos_blk_offset + v->pos_offset;
+	long i;
+
+	if (blk != v->pos_blk || offset != v->pos_offset) {
+		long nl = count_nl(blk->data, offset);
+
+		v->pos_blk_offset += v->pos_offset - offset;
+		v->pos_blk_line += v->pos_line - nl;
+		v->pos_blk = blk;
+		v->pos_offset = offset;
+		v->pos_line = nl;
+	}
+
+	// cached blocks of other views may have been freed
+	for (i = 0; i < b->views.count; i++) {
+		struct view *other = b->views.ptrs[i];
+		if (other != v)
+			other->pos_blk = NULL;
+		view_columns_edited(other, edit_offset);
+	}
+
+	if (DEBUG > 2)
+		check_cursor_pos(v);
+}
+
+// advance cp to first character boundary at or after end
+static void count_columns(const unsigned char *line, long size, unsigned int tw, long end, struct column_checkpoint *cp)
+{
+	long idx = cp->idx;
+	int c = cp->x_char;
+	int w = cp->x_display;
+
+	while (idx < end) {
+		unsigned int u = line[idx++];
 
 		c++;
 		if (likely(u < 0x80)) {
@@ -44,12 +147,81 @@ void view_update_cursor_x(struct view *v)
 			}
 		} else {
 			idx--;
-			u = u_get_nonascii(lr.line, lr.size, &idx);
+			u = u_get_nonascii(line, size, &idx);
 			w += u_char_width(u);
 		}
 	}
-	v->cx_char = c;
-	v->cx_display = w;
+	cp->idx = idx;
+	cp->x_char = c;
+	cp->x_display = w;
+}
+
+/*
+ * Returns last checkpoint of line (without newline) at absolute offset
+ * bol which is before byte idx and display column x_display. Typing in
+ * a long line then costs scanning at most COLUMN_CHECKPOINT bytes instead
+ * of the whole line.
+ *
+ * Checkpoints are added as needed and forgotten in view_cursor_edited()
+ * when the text before them changes.
+ */
+const struct column_checkpoint *view_get_columns(struct view *v, const unsigned char *line, long size, long bol, long idx, int x_display)
+{
+	unsigned int tw = v->buffer->options.tab_width;
+	struct column_checkpoint *cp;
+	long low, high;
+
+	if (!v->col_count || v->col_bol != bol || v->col_tab_width != tw) {
+		v->col_count = 0;
+		v->col_bol = bol;
+		v->col_tab_width = tw;
+		if (!v->col_alloc) {
+			v->col_alloc = 64;
+			xrenew(v->col_ptr, v->col_alloc);
+		}
+		clear(&v->col_ptr[v->col_count++]);
+	}
+
+	cp = &v->col_ptr[v->col_count - 1];
+	while (cp->idx + COLUMN_CHECKPOINT <= idx && cp->x_display < x_display) {
+		if (v->col_count == v->col_alloc) {
+			v->col_alloc *= 2;
+			xrenew(v->col_ptr, v->col_alloc);
+		}
+		v->col_ptr[v->col_count] = v->col_ptr[v->col_count - 1];
+		cp = &v->col_ptr[v->col_count++];
+		count_columns(line, size, tw, cp->idx + COLUMN_CHECKPOINT, cp);
+	}
+
+	// first checkpoint is always before idx and x_display
+	low = 0;
+	high = v->col_count;
+	while (high - low > 1) {
+		long mid = (low + high) / 2;
+
+		cp = &v->col_ptr[mid];
+		if (cp->idx <= idx && cp->x_display <= x_display) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	return &v->col_ptr[low];
+}
+
+void view_update_cursor_x(struct view *v)
+{
+	struct column_checkpoint cp = { 0, 0, 0 };
+	struct lineref lr;
+
+	v->cx = fetch_this_line(&v->cursor, &lr);
+	if (v->cx >= COLUMN_CHECKPOINT) {
+		long bol = view_get_cursor_offset(v) - v->cx;
+		cp = *view_get_columns(v, lr.line, lr.size, bol, v->cx, INT_MAX);
+	}
+	count_columns(lr.line, lr.size, v->buffer->options.tab_width, v->cx, &cp);
+	v->cx_char = cp.x_char;
+	v->cx_display = cp.x_display;
 }
 
 static int view_is_cursor_visible(struct view *v)
@@ -4,6 +4,16 @@
 #include "libc.h"
 #include "iter.h"
 
+// lines shorter than this are always scanned from the beginning
+#define COLUMN_CHECKPOINT (64 * 1024)
+
+// columns of a character boundary in a long line, see view_get_columns()
+struct column_checkpoint {
+	long idx;
+	int x_char;
+	int x_display;
+};
+
 enum selection {
 	SELECT_NONE,
 	SELECT_CHARS,
@@ -56,6 +66,22 @@ struct view {
 	// sharing same buffer.
 	bool restore_cursor;
 	long saved_cursor_offset;
+
+	// Cached position of cursor, see view_update_cursor_pos().
+	// pos_blk is NULL if the cache is invalid.
+	struct block *pos_blk;
+	long pos_blk_offset;	// bytes before pos_blk
+	long pos_blk_line;	// lines before pos_blk
+	long pos_offset;	// offset inside pos_blk
+	long pos_line;		// newlines in pos_blk before pos_offset
+
+	// Checkpoints every COLUMN_CHECKPOINT bytes of one long line starting
+	// at absolute offset col_bol. Empty if col_count is 0.
+	struct column_checkpoint *col_ptr;
+	long col_count;
+	long col_alloc;
+	long col_bol;
+	unsigned int col_tab_width;
 };
 
 static inline void view_reset_preferred_x(struct view *v)
@@ -64,6 +90,9 @@ static inline void view_reset_preferred_x(struct view *v)
 }
 
 void view_update_cursor_y(struct view *v);
+long view_get_cursor_offset(struct view *v);
+void view_cursor_edited(struct view *v);
+const struct column_checkpoint *view_get_columns(struct view *v, const unsigned char *line, long size, long bol, long idx, int x_display);
 void view_update_cursor_x(struct view *v);
 void view_update(struct view *v);
 int view_get_preferred_x(struct view *v);
@@ -4,6 +4,8 @@
 #include "path.h"
 #include "lock.h"
 #include "load-save.h"
+#include "journal.h"
+#include "undo-file.h"
 #include "error.h"
 #include "move.h"
 #include "frame.h"
@@ -201,6 +203,7 @@ void remove_view(struct view *v)
 			add_file_history(v->cy + 1, v->cx_char + 1, b->abs_filename);
 		free_buffer(b);
 	}
+	free(v->col_ptr);
 	free(v);
 }
 
@@ -271,6 +274,8 @@ void set_view(struct view *v)
 
 	if (!v->buffer->setup) {
 		buffer_setup(v->buffer);
+		load_undo_history(v->buffer);
+		journal_recover(v->buffer);
 		if (v->buffer->options.file_history && v->buffer->abs_filename != NULL) {
 			restore_cursor_from_history(v);
 		}